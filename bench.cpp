@@ -0,0 +1,288 @@
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <omp.h>
+#include "SLIC.h"
+#include "ppm.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+//===========================================================================
+/// Benchmark harness
+///
+/// Runs PerformSLICO_ForGivenK on each case runs times after warmup untimed
+/// runs, and reports min/median/p95 of every phase of SLIC::Stats plus the
+/// wall clock time around the call. The labels of every run are checked
+/// against the case's check.ppm when K is the one it was made with; any
+/// difference makes the harness exit with status 1.
+//===========================================================================
+
+struct bench_case
+{
+	int id;
+	int K; //the K check.ppm was produced with
+};
+
+static const bench_case cases[] = {{1, 200}, {2, 400}, {3, 150}};
+static const double compactness = 10.0; //passed as main does, SLICO does not use it
+
+static const char *phase_names[] = {"rgb2lab", "seeds", "segmentation", "connectivity", "total", "wall"};
+static const int num_phases = 6;
+
+struct phase_summary
+{
+	double min, median, p95;
+};
+
+struct case_result
+{
+	int id;
+	int width, height;
+	int K;
+	int labels;
+	int iterations;
+	int mismatches; //-1 when not checked
+	const char *isa;
+	phase_summary phases[num_phases];
+};
+
+//===========================================================================
+///	Summarize
+///
+/// min, median and nearest rank 95th percentile of the samples.
+//===========================================================================
+static phase_summary Summarize(vector<double> samples)
+{
+	phase_summary s;
+	std::sort(samples.begin(), samples.end());
+	const size_t n = samples.size();
+	s.min = samples[0];
+	s.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	size_t rank = (size_t)ceil(0.95 * n);
+	s.p95 = samples[rank > 0 ? rank - 1 : 0];
+	return s;
+}
+
+static void Usage(const char *name)
+{
+	std::cerr << "usage: " << name << " [-n runs] [-w warmup] [-k K]"
+			  << " [-f text|csv|json] [-o file] [case ...]" << std::endl
+			  << "  cases are 1, 2 and 3 (default: all); K defaults to each case's own" << std::endl;
+}
+
+static void WriteText(std::ostream &os, const vector<case_result> &results, int runs, int warmup)
+{
+	os << "isa " << (results.empty() ? "" : results[0].isa) << ", " << omp_get_max_threads() << " threads, "
+	   << runs << " runs after " << warmup << " warmup" << std::endl;
+	for (size_t c = 0; c < results.size(); c++)
+	{
+		const case_result &r = results[c];
+		os << "Case " << r.id << " (" << r.width << " x " << r.height << ", K=" << r.K
+		   << ", " << r.labels << " labels, " << r.iterations << " iterations)" << std::endl;
+		for (int p = 0; p < num_phases; p++)
+		{
+			const phase_summary &s = r.phases[p];
+			os << "  " << phase_names[p] << ": min " << s.min << " ms, median " << s.median
+			   << " ms, p95 " << s.p95 << " ms" << std::endl;
+		}
+		if (r.mismatches < 0)
+			os << "  check: skipped (K differs from check.ppm)" << std::endl;
+		else
+			os << "  check: " << r.mismatches << " labels differ from check.ppm" << std::endl;
+	}
+}
+
+static void WriteCSV(std::ostream &os, const vector<case_result> &results, int runs)
+{
+	os << "case,width,height,K,threads,isa,runs,phase,min_ms,median_ms,p95_ms,mismatches" << std::endl;
+	for (size_t c = 0; c < results.size(); c++)
+	{
+		const case_result &r = results[c];
+		for (int p = 0; p < num_phases; p++)
+		{
+			const phase_summary &s = r.phases[p];
+			os << r.id << "," << r.width << "," << r.height << "," << r.K << ","
+			   << omp_get_max_threads() << "," << r.isa << "," << runs << ","
+			   << phase_names[p] << "," << s.min << "," << s.median << "," << s.p95 << ","
+			   << r.mismatches << std::endl;
+		}
+	}
+}
+
+static void WriteJSON(std::ostream &os, const vector<case_result> &results, int runs, int warmup)
+{
+	os << "{\"isa\": \"" << (results.empty() ? "" : results[0].isa) << "\", \"threads\": " << omp_get_max_threads()
+	   << ", \"runs\": " << runs << ", \"warmup\": " << warmup << ", \"cases\": [" << std::endl;
+	for (size_t c = 0; c < results.size(); c++)
+	{
+		const case_result &r = results[c];
+		os << "  {\"case\": " << r.id << ", \"width\": " << r.width << ", \"height\": " << r.height
+		   << ", \"K\": " << r.K << ", \"labels\": " << r.labels
+		   << ", \"iterations\": " << r.iterations << ", \"mismatches\": ";
+		if (r.mismatches < 0)
+			os << "null";
+		else
+			os << r.mismatches;
+		os << ", \"phases\": {";
+		for (int p = 0; p < num_phases; p++)
+		{
+			const phase_summary &s = r.phases[p];
+			os << (p ? ", " : "") << "\"" << phase_names[p] << "\": {\"min_ms\": " << s.min
+			   << ", \"median_ms\": " << s.median << ", \"p95_ms\": " << s.p95 << "}";
+		}
+		os << "}}" << (c + 1 < results.size() ? "," : "") << std::endl;
+	}
+	os << "]}" << std::endl;
+}
+
+//===========================================================================
+///	The main function
+///
+//===========================================================================
+int main(int argc, char **argv)
+{
+	int runs = 10;
+	int warmup = 2;
+	int K = 0; //0: each case's own
+	string format = "text";
+	const char *output = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:w:k:f:o:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'k':
+			K = atoi(optarg);
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+	if (runs < 1 || warmup < 0 || K < 0 || (format != "text" && format != "csv" && format != "json"))
+	{
+		Usage(argv[0]);
+		return 2;
+	}
+
+	vector<bench_case> selected;
+	for (int i = optind; i < argc; i++)
+	{
+		const int id = atoi(argv[i]);
+		if (id < 1 || id > 3)
+		{
+			Usage(argv[0]);
+			return 2;
+		}
+		selected.push_back(cases[id - 1]);
+	}
+	if (selected.empty())
+		selected.assign(cases, cases + 3);
+
+	vector<case_result> results;
+	bool failed = false;
+	SLIC slic;
+	for (size_t c = 0; c < selected.size(); c++)
+	{
+		const bench_case &bc = selected[c];
+		char input[64], check[64];
+		snprintf(input, sizeof(input), "data/case%d/input_image.ppm", bc.id);
+		snprintf(check, sizeof(check), "data/case%d/check.ppm", bc.id);
+
+		void *map = NULL;
+		size_t mapsize = 0;
+		const unsigned char *img = NULL;
+		int width(0);
+		int height(0);
+		if (!MapPPM(input, &map, &mapsize, &img, &width, &height))
+		{
+			std::cerr << "cannot read " << input << std::endl;
+			return 2;
+		}
+
+		case_result r;
+		r.id = bc.id;
+		r.width = width;
+		r.height = height;
+		r.K = K ? K : bc.K;
+		const bool checked = r.K == bc.K;
+		r.mismatches = checked ? 0 : -1;
+
+		vector<int> labels((size_t)width * height);
+		vector<double> samples[num_phases];
+		int numlabels(0);
+		for (int run = -warmup; run < runs; run++)
+		{
+			auto startTime = Clock::now();
+			slic.PerformSLICO_ForGivenK(img, (size_t)width * 3, width, height, labels.data(), numlabels, r.K, compactness);
+			auto endTime = Clock::now();
+
+			if (checked)
+			{
+				const int num = CheckLabelswithPPM(check, labels.data(), width, height);
+				if (num != 0)
+				{
+					r.mismatches = num < 0 ? width * height : max(r.mismatches, num);
+					failed = true;
+				}
+			}
+			if (run < 0)
+				continue;
+
+			const SLIC::Stats &st = slic.GetStats();
+			samples[0].push_back(st.rgb2lab_ms);
+			samples[1].push_back(st.seeds_ms);
+			samples[2].push_back(st.segmentation_ms);
+			samples[3].push_back(st.connectivity_ms);
+			samples[4].push_back(st.total_ms);
+			samples[5].push_back(chrono::duration_cast<chrono::nanoseconds>(endTime - startTime).count() / 1e6);
+			r.labels = numlabels;
+			r.iterations = st.iterations;
+			r.isa = st.isa;
+		}
+		for (int p = 0; p < num_phases; p++)
+			r.phases[p] = Summarize(samples[p]);
+		results.push_back(r);
+		UnmapPPM(map, mapsize);
+	}
+
+	std::ofstream file;
+	if (output)
+	{
+		file.open(output);
+		if (!file)
+		{
+			std::cerr << "cannot write " << output << std::endl;
+			return 2;
+		}
+	}
+	std::ostream &os = output ? file : std::cout;
+	if (format == "csv")
+		WriteCSV(os, results, runs);
+	else if (format == "json")
+		WriteJSON(os, results, runs, warmup);
+	else
+		WriteText(os, results, runs, warmup);
+
+	if (failed)
+		std::cerr << "labels differ from check.ppm" << std::endl;
+	return failed ? 1 : 0;
+}
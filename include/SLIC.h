@@ -26,12 +26,128 @@
 
 #include <vector>
 #include <string>
+#include <ostream>
 #include <algorithm>
+#include <cstdio>
+#include <cfloat>
 using namespace std;
 
+//============================================================================
+// Storage type of the Lab planes and the per pixel distance buffers. Build
+// with -DSLIC_SINGLE_PRECISION to halve their memory traffic; seeds and the
+// centroid sums stay in double either way.
+//============================================================================
+#if defined(SLIC_SINGLE_PRECISION)
+typedef float lab_t;
+#define LAB_MAX FLT_MAX
+#else
+typedef double lab_t;
+#define LAB_MAX DBL_MAX
+#endif
+
+class area_info
+{
+public:
+	int index;
+	int x, y;
+	int count;
+	int new_label;
+	int seg_label;
+	int adjacent_index;
+
+	bool operator<(const area_info &other)
+	{
+		return index < other.index;
+	}
+};
+
+//============================================================================
+// Running sums of one cluster for the centroid update. Each thread has its
+// own array of these; one entry fills a cache line so threads never share.
+//============================================================================
+struct alignas(64) cluster_sum
+{
+	double l, a, b;
+	double x, y;
+	double maxlab;
+	double z; //supervoxels only
+	int count;
+};
+
+//============================================================================
+// One pixel of the interleaved layout (SetInterleavedLayout): the three Lab
+// channels padded to four, so a pixel never straddles a cache line.
+//============================================================================
+struct lab_pixel
+{
+	lab_t l, a, b;
+	lab_t pad;
+};
+
+//============================================================================
+// A seed as the assignment step reads it, packed once per iteration from the
+// separate kseeds vectors.
+//============================================================================
+struct lab_seed
+{
+	double l, a, b;
+	double x, y;
+	double maxlab;
+};
+
 class SLIC
 {
 public:
+	//============================================================================
+	// Timings and sizes of the last PerformSLICO_ForGivenK call. Times are wall
+	// clock milliseconds; assign_ms/update_ms have one entry per iteration.
+	//============================================================================
+	struct Stats
+	{
+		double rgb2lab_ms;
+		double seeds_ms;
+		double segmentation_ms;
+		double connectivity_ms;
+		double total_ms;
+		vector<double> assign_ms;
+		vector<double> update_ms;
+		long long pixels;
+		long long distances; //pixel-seed distance evaluations, all iterations
+		int seeds;
+		int iterations;
+		double residual;
+		int labels;
+		const char *isa; //kernel variant picked by cpuid: generic, sse4.2, avx2 or avx512
+		bool warm;		 //seeded from the previous frame, see SetWarmStart
+		long long dirty; //pixels reassigned, less than pixels for PerformSLICO_Incremental
+
+		Stats() : rgb2lab_ms(0), seeds_ms(0), segmentation_ms(0), connectivity_ms(0), total_ms(0),
+				  pixels(0), distances(0), seeds(0), iterations(0), residual(0), labels(0), isa(""), warm(false),
+				  dirty(0) {}
+	};
+
+	//============================================================================
+	// One image of a PerformSLICO_Batch call. Either rgb/stride (packed 24 bit,
+	// as the second PerformSLICO_ForGivenK) or ubuff (ARGB) is set; klabels
+	// must hold width * height labels. numlabels and stats are filled in.
+	//============================================================================
+	struct BatchImage
+	{
+		const unsigned char *rgb;
+		size_t stride;
+		const unsigned int *ubuff;
+		int width;
+		int height;
+		int K;
+		double m;
+		int *klabels;
+		int numlabels;
+		Stats stats;
+
+		BatchImage() : rgb(NULL), stride(0), ubuff(NULL), width(0), height(0), K(0), m(10),
+					   klabels(NULL), numlabels(0) {}
+	};
+
 	SLIC();
 	virtual ~SLIC();
 
@@ -47,6 +163,160 @@ public:
 		const int &K,
 		const double &m);
 
+	//============================================================================
+	// Same as above for a packed 24 bit image that is read in place, such as a
+	// memory mapped P6 payload. Pixels are 3 bytes, with byte 2 taken as the
+	// red channel (the byte the ARGB version expects in bits 16..23).
+	//============================================================================
+	void PerformSLICO_ForGivenK(
+		const unsigned char *rgb,
+		const size_t stride, //Bytes between the starts of two consecutive rows.
+		const int width,
+		const int height,
+		int *klabels,
+		int &numlabels,
+		const int &K,
+		const double &m);
+
+	//============================================================================
+	// Supervoxel segmentation of a depth x height x width volume, such as an
+	// image stack or a short clip: the same zero parameter SLICO clustering in
+	// x, y and z, then 6-connected connectivity enforcement, so a label means
+	// the same region in every slice. ubuffvec and klabels hold depth slices of
+	// width * height ARGB pixels and labels.
+	//============================================================================
+	void PerformSupervoxelSLICO_ForGivenK(
+		const unsigned int **ubuffvec,
+		const int width,
+		const int height,
+		const int depth,
+		int **klabels,
+		int &numlabels,
+		const int &K,
+		const double &m);
+
+	//============================================================================
+	// Out of core segmentation of images too large to hold, such as gigapixel
+	// slides. read fills rows [y, y + rows) as ARGB, width pixels per row; write
+	// gets the final labels of rows [y, y + rows), top to bottom. The image is
+	// streamed in bands of bandrows rows, the Lab values and labels kept
+	// between passes in temporary files, so memory stays O(bandrows * width +
+	// K) for any height. Labels match PerformSLICO_ForGivenK's. Returns false
+	// if the temporary files cannot be created or written.
+	//============================================================================
+	typedef void (*read_rows_fn)(void *user, const int y, const int rows, unsigned int *argb);
+	typedef void (*write_rows_fn)(void *user, const int y, const int rows, const int *labels);
+
+	bool PerformSLICO_OutOfCore(
+		read_rows_fn read,
+		write_rows_fn write,
+		void *user,
+		const int width,
+		const int height,
+		const int &bandrows,
+		int &numlabels,
+		const int &K,
+		const double &m);
+
+	//============================================================================
+	// Convert RGB to Lab through a lazily built 24 bit table shared by all
+	// instances (384 MB in double). Off by default.
+	//============================================================================
+	void SetRGBtoLABTable(const bool &enable);
+
+	//============================================================================
+	// Run the assignment over S x S tiles, each visiting only the seeds that
+	// reach it, instead of over full image rows. Same labels; pays off when a
+	// row band of the image no longer fits in L2. Off by default.
+	//============================================================================
+	void SetTiledAssignment(const bool &enable);
+
+	//============================================================================
+	// Keep an interleaved copy of the Lab planes, one lab_pixel per pixel, and
+	// run the assignment on it instead of on the three planes. Same labels;
+	// costs one packing pass and 4 lab_t per pixel. Off by default.
+	//============================================================================
+	void SetInterleavedLayout(const bool &enable);
+
+	//============================================================================
+	// Stop the clustering once the residual error E (mean centroid
+	// displacement, in grid steps S) falls below threshold, after at most maxitr
+	// iterations. threshold <= 0 runs exactly maxitr; default is 0 and 10.
+	//============================================================================
+	void SetConvergence(const double &threshold, const int &maxitr);
+
+	//============================================================================
+	// Streaming mode for video: a PerformSLICO_ForGivenK with the same width,
+	// height and K as the previous one starts from that run's final centroids
+	// and maxlab instead of a fresh grid, and stops once E falls below
+	// threshold (at most maxitr iterations from SetConvergence). The first
+	// frame, or any change of size or K, is seeded as usual. Off by default.
+	//============================================================================
+	void SetWarmStart(const bool &enable, const double &threshold);
+
+	//============================================================================
+	// Convergence of PerformSLICO_Incremental, whatever SetWarmStart says: the
+	// moving seeds stop once their E falls below threshold, after at most
+	// maxitr iterations from SetConvergence. threshold <= 0 runs exactly
+	// maxitr; default is 0.
+	//============================================================================
+	void SetIncrementalConvergence(const double &threshold);
+
+	//============================================================================
+	// Next frame of a stream, redone only where it changed. klabels holds the
+	// labels the previous call returned and is updated in place. changed marks
+	// the changed pixels (width * height bytes, nonzero = changed); when NULL,
+	// the pixels whose R, G or B moved by more than threshold since the last
+	// frame are taken. Seeds whose 2S window reaches a change move, starting
+	// from where they were as with SetWarmStart, until the threshold of
+	// SetIncrementalConvergence; the S x S tiles those windows reach are
+	// reassigned and get their connectivity redone, the rest keeps its labels
+	// but for pieces the reassignment cut off from their label, which are
+	// relabelled. Label values persist across frames, so some fall out of use
+	// and numlabels is one past the largest. The first frame, or a change of
+	// size or K, runs PerformSLICO_ForGivenK.
+	//============================================================================
+	void PerformSLICO_Incremental(
+		const unsigned int *ubuff,
+		const int width,
+		const int height,
+		int *klabels,
+		int &numlabels,
+		const int &K,
+		const double &m,
+		const unsigned char *changed,
+		const int &threshold);
+
+	//============================================================================
+	// Iterations run and residual error E of the last segmentation.
+	//============================================================================
+	int GetIterationCount() const;
+	double GetResidualError() const;
+
+	//============================================================================
+	// Per phase statistics of the last run. Printing them after each run is
+	// opt-in with SetVerbose(true).
+	//============================================================================
+	const Stats &GetStats() const;
+	void SetVerbose(const bool &verbose);
+	void PrintStats(std::ostream &os) const;
+
+	//============================================================================
+	// Segment many images with one thread pool. Images of at least
+	// SetBatchThreshold pixels run one after another, each using all threads;
+	// the smaller ones are spread over the threads, one image per thread at a
+	// time. Settings of this instance (convergence, layout, table) apply to
+	// every image. Labels are the same as one PerformSLICO_ForGivenK per image.
+	//============================================================================
+	void PerformSLICO_Batch(vector<BatchImage> &images);
+	void SetBatchThreshold(const int &pixels);
+
+	//============================================================================
+	// Pre-size the reusable workspace for images up to width x height. Buffers
+	// only grow; optional, PerformSLICO_ForGivenK does it as needed.
+	//============================================================================
+	void ReserveWorkspace(const int &width, const int &height);
+
 	//============================================================================
 	// Save superpixel labels to pgm in raster scan order
 	//============================================================================
@@ -57,6 +327,15 @@ public:
 		const int height);
 
 private:
+	//============================================================================
+	// Seeding, clustering and connectivity on the already converted Lab planes.
+	//============================================================================
+	void PerformSLICO_OnLAB(
+		int *klabels,
+		int &numlabels,
+		const int &K,
+		const double &m);
+
 	//============================================================================
 	// Magic SLIC. No need to set M (compactness factor) and S (step size).
 	// SLICO (SLIC Zero) varies only M dynamicaly, not S.
@@ -69,7 +348,88 @@ private:
 		vector<double> &kseedsy,
 		int *klabels,
 		const int &STEP,
+		const int &NUMITR,
+		const bool &warm, //keep maxlab of the previous run and use the warm start threshold,
+						  //or the incremental one with dirtytiles
+		const vector<int> *dirtytiles,
+		const vector<char> *active);
+
+	//============================================================================
+	// PerformSLICO_OutOfCore passes: conversion to labfile with the seeding,
+	// the clustering iterations over labfile into labelfile, and the
+	// connectivity from labelfile to write.
+	//============================================================================
+	bool GetLABXYSeeds_OutOfCore(
+		read_rows_fn read,
+		void *user,
+		const int &bandrows,
+		FILE *labfile,
+		const int &K);
+	bool PerformSuperpixelSegmentation_OutOfCore(
+		const int &bandrows,
+		FILE *labfile,
+		FILE *labelfile,
+		const int &STEP,
 		const int &NUMITR);
+	bool EnforceLabelConnectivity_OutOfCore(
+		write_rows_fn write,
+		void *user,
+		const int &bandrows,
+		FILE *labelfile,
+		const int &halo,
+		int &numlabels,
+		const int &K);
+
+	//============================================================================
+	// PerformSLICO_Incremental helpers: the per pixel, per seed and per label
+	// state a full run leaves for the following frames, and the connectivity
+	// of the dirty tiles against the labels around them.
+	//============================================================================
+	void InitIncrementalState(const unsigned int *ubuff, const int *klabels, const int &numlabels);
+	void EnforceDirtyTileConnectivity(int *klabels, const int &tilesize, int &numlabels, const int &K);
+
+	//============================================================================
+	// Supervoxel counterparts of GetLABXYSeeds_ForGivenK,
+	// PerformSuperpixelSegmentation_VariableSandM and EnforceLabelConnectivity.
+	// The seeding returns the seed spacing within a slice.
+	//============================================================================
+	double GetLABXYZSeeds_ForGivenK(const int &K);
+	void PerformSupervoxelSegmentation_VariableSandM(
+		int **klabels,
+		const int &STEP,
+		const int &NUMITR);
+	void EnforceSupervoxelLabelConnectivity(
+		int **labels,
+		const int &width,
+		const int &height,
+		const int &depth,
+		int &numlabels,
+		const int &K);
+	void ReserveSupervoxelWorkspace(const int &width, const int &height, const int &depth);
+
+	//============================================================================
+	// Bin seeds into row bands, optionally cut into tiles, so each row or tile
+	// only visits the seeds that reach it. width and height are the extents of
+	// the two coordinates, normally the image's.
+	//============================================================================
+	void BuildSeedBands(
+		const vector<double> &kseedsx,
+		const vector<double> &kseedsy,
+		const int &width,
+		const int &height,
+		const int &offset,
+		const int &bandheight,
+		const int &tilewidth,
+		vector<int> &bandstart,
+		vector<int> &bandseeds);
+
+	void ReserveClusterSums(const size_t &count);
+	void ReserveDistanceRows(const size_t &count);
+
+	//============================================================================
+	// Fill m_labxy from the Lab planes for the interleaved layout.
+	//============================================================================
+	void PackLabPixels();
 
 	//============================================================================
 	// Pick seeds for superpixels when number of superpixels is input.
@@ -99,9 +459,9 @@ private:
 	// Detect color edges, to help PerturbSeeds()
 	//============================================================================
 	void DetectLabEdges(
-		const double *lvec,
-		const double *avec,
-		const double *bvec,
+		const lab_t *lvec,
+		const lab_t *avec,
+		const lab_t *bvec,
 		const int &width,
 		const int &height,
 		vector<double> &edges);
@@ -133,10 +493,24 @@ private:
 	// sRGB to CIELAB conversion for 2-D images
 	//============================================================================
 	void DoRGBtoLABConversion(
-		const unsigned int *&ubuff,
-		double *&lvec,
-		double *&avec,
-		double *&bvec);
+		const unsigned int *ubuff,
+		lab_t *lvec,
+		lab_t *avec,
+		lab_t *bvec);
+	void DoRGBtoLABConversion(
+		const unsigned int **ubuffvec,
+		lab_t **lvecvec,
+		lab_t **avecvec,
+		lab_t **bvecvec);
+	void DoRGBtoLABConversion(
+		const unsigned char *rgb,
+		const size_t &stride,
+		lab_t *lvec,
+		lab_t *avec,
+		lab_t *bvec);
+	void InitRGBtoLABLUT();
+	static const lab_t *GetRGBtoLABTable();
+	static lab_t *BuildRGBtoLABTable();
 
 	//============================================================================
 	// Post-processing of SLIC segmentation, to avoid stray labels.
@@ -145,39 +519,93 @@ private:
 		int *labels,
 		const int &width,
 		const int &height,
-		int *nlabels,	//input labels that need to be corrected to remove stray labels
+		int *nlabels,	//scratch buffer of the same size as labels
 		int &numlabels, //the number of labels changes in the end if segments are removed
 		const int &K);	//the number of superpixels desired by the user
 
 private:
 	double rgb_lut[256];
 	double rgb_pow_lut[256];
+	bool m_use_lab_table;
+	bool m_tiled;
+	bool m_interleaved;
+	double m_threshold;
+	int m_maxitr;
+	bool m_warm;
+	double m_warm_threshold;
+	double m_incremental_threshold;
+	bool m_verbose;
+	Stats m_stats;
 	int m_width;
 	int m_height;
 	int m_depth;
 
-	double *m_lvec;
-	double *m_avec;
-	double *m_bvec;
+	// Workspace reused across calls, m_workspace_size pixels each
+	lab_t *m_lvec;
+	lab_t *m_avec;
+	lab_t *m_bvec;
+	size_t m_workspace_size;
+	// One row per thread, m_distrows_size entries each
+	lab_t *m_distlab;
+	lab_t *m_distvec;
+	size_t m_distrows_size;
+	lab_pixel *m_labxy; //interleaved copy, only with SetInterleavedLayout
+	size_t m_labxy_size;
+	bool m_labxy_packed; //m_labxy matches the planes
 
-	double **m_lvecvec;
-	double **m_avecvec;
-	double **m_bvecvec;
-};
+	// Seeds, maxlab and the seed band/tile index of the last run. A warm start
+	// reuses the seeds and maxlab when the run had m_warm_width x m_warm_height
+	// pixels and m_warm_K superpixels (0: nothing to reuse).
+	int m_warm_width;
+	int m_warm_height;
+	int m_warm_K;
+	vector<double> m_kseedsl;
+	vector<double> m_kseedsa;
+	vector<double> m_kseedsb;
+	vector<double> m_kseedsx;
+	vector<double> m_kseedsy;
+	vector<double> m_kseedsz; //supervoxels only
+	vector<double> m_maxlab;
+	vector<lab_seed> m_seeds;
+	vector<int> m_seedrows; //first seed of each hex grid row
+	vector<int> m_bandstart;
+	vector<int> m_bandseeds;
+	vector<int> m_bandcursor;
 
-class area_info
-{
-public:
-	int index;
-	int x, y;
-	int count;
-	int new_label;
-	int seg_label;
+	// Supervoxel Lab slices, m_depth slices of m_slice_size pixels each
+	lab_t **m_lvecvec;
+	lab_t **m_avecvec;
+	lab_t **m_bvecvec;
+	size_t m_slice_size;
+	vector<size_t> m_voxelqueue;
 
-	bool operator<(const area_info &other)
-	{
-		return index < other.index;
-	}
+	// Per thread cluster sums, reused across iterations and calls
+	cluster_sum *m_clustersums;
+	size_t m_clustersums_size;
+
+	// EnforceLabelConnectivity scratch, reused across calls
+	vector<int> m_nlabels;
+	vector<area_info> m_seginfo;
+	vector<int> m_striproots;
+	vector<int> m_newlabel;
+
+	// PerformSLICO_Incremental state of the last frame: its pixels, labels
+	// before connectivity (kept while m_keep_rawlabels), the final label of
+	// each seed and the pixel count of each label; then per frame, the tile
+	// flags (1 changed, 2 reassigned), the reassigned tiles and moving seeds.
+	bool m_keep_rawlabels;
+	vector<unsigned int> m_prevframe;
+	vector<int> m_rawlabels;
+	vector<int> m_seedlabel;
+	vector<int> m_labelcount;
+	vector<char> m_tileflags;
+	vector<int> m_dirtytiles;
+	vector<char> m_activeseeds;
+	vector<int> m_dirtyqueue;
+
+	// Batch mode: one instance per thread for the small images, kept across calls
+	int m_batch_threshold;
+	vector<SLIC *> m_workers;
 };
 
 #endif // !defined(_SLIC_H_INCLUDED_)
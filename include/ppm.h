@@ -0,0 +1,23 @@
+// ppm.h: P6 image helpers shared by main and bench.
+//===========================================================================
+
+#if !defined(_PPM_H_INCLUDED_)
+#define _PPM_H_INCLUDED_
+
+#include <stddef.h>
+
+//===========================================================================
+// Map a P6 file read-only and parse its header in place. rgb points at the
+// first pixel of the payload inside the mapping, rows are 3 * width bytes
+// apart. Release with UnmapPPM.
+//===========================================================================
+bool MapPPM(char *filename, void **map, size_t *mapsize, const unsigned char **rgb, int *width, int *height);
+void UnmapPPM(void *map, size_t mapsize);
+
+//===========================================================================
+// Number of labels that differ from a label image saved as P6, -1 if its
+// size does not match.
+//===========================================================================
+int CheckLabelswithPPM(char *filename, int *labels, int width, int height);
+
+#endif // !defined(_PPM_H_INCLUDED_)
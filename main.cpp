@@ -1,124 +1,56 @@
 #include <iostream>
 #include <chrono>
+#include <vector>
 #include "SLIC.h"
+#include "ppm.h"
 
 typedef std::chrono::high_resolution_clock Clock;
 
 //===========================================================================
-/// Load PPM file
-///
-///
-//===========================================================================
-void LoadPPM(char *filename, unsigned int **data, int *width, int *height)
-{
-	char header[1024];
-	FILE *fp = NULL;
-	int line = 0;
-
-	fp = fopen(filename, "rb");
-
-	// read the image type, such as: P6
-	// skip the comment lines
-	while (line < 2)
-	{
-		fgets(header, 1024, fp);
-		if (header[0] != '#')
-		{
-			++line;
-		}
-	}
-	// read width and height
-	sscanf(header, "%d %d\n", width, height);
-
-	// read the maximum of pixels
-	fgets(header, 20, fp);
-
-	// get rgb data
-	unsigned char *rgb = new unsigned char[(*width) * (*height) * 3];
-	fread(rgb, (*width) * (*height) * 3, 1, fp);
-
-	*data = new unsigned int[(*width) * (*height) * 4];
-	int k = 0;
-	for (int i = 0; i < (*height); i++)
-	{
-		for (int j = 0; j < (*width); j++)
-		{
-			unsigned char *p = rgb + i * (*width) * 3 + j * 3;
-			// a ( skipped )
-			(*data)[k] = p[2] << 16; // r
-			(*data)[k] |= p[1] << 8; // g
-			(*data)[k] |= p[0];		 // b
-			k++;
-		}
-	}
-
-	// ofc, later, you'll have to cleanup
-	delete[] rgb;
-
-	fclose(fp);
-}
-
-//===========================================================================
-/// Load PPM file
-///
+///	CountSplitLabels
 ///
+///	Number of labels made of more than one 4-connected component.
 //===========================================================================
-int CheckLabelswithPPM(char *filename, int *labels, int width, int height)
+static int CountSplitLabels(const int *labels, int width, int height, int numlabels)
 {
-	char header[1024];
-	FILE *fp = NULL;
-	int line = 0, ground = 0;
-
-	fp = fopen(filename, "rb");
-
-	// read the image type, such as: P6
-	// skip the comment lines
-	while (line < 2)
-	{
-		fgets(header, 1024, fp);
-		if (header[0] != '#')
-		{
-			++line;
-		}
-	}
-	// read width and height
-	int w(0);
-	int h(0);
-	sscanf(header, "%d %d\n", &w, &h);
-	if (w != width || h != height)
-		return -1;
-
-	// read the maximum of pixels
-	fgets(header, 20, fp);
-
-	// get rgb data
-	unsigned char *rgb = new unsigned char[(w) * (h)*3];
-	fread(rgb, (w) * (h)*3, 1, fp);
-
-	int num = 0, k = 0;
-	for (int i = 0; i < (h); i++)
+	const int dx4[4] = {-1, 0, 1, 0};
+	const int dy4[4] = {0, -1, 0, 1};
+	const int sz = width * height;
+	std::vector<char> visited(sz, 0);
+	std::vector<char> seen(numlabels, 0);
+	std::vector<int> queue(sz);
+	int split = 0;
+	for (int i = 0; i < sz; i++)
 	{
-		for (int j = 0; j < (w); j++)
+		if (visited[i])
+			continue;
+		const int label = labels[i];
+		if (seen[label])
+			split++;
+		seen[label] = 1;
+		int count = 1;
+		queue[0] = i;
+		visited[i] = 1;
+		for (int c = 0; c < count; c++)
 		{
-			unsigned char *p = rgb + i * (w)*3 + j * 3;
-			// a ( skipped )
-			ground = p[2] << 16; // r
-			ground |= p[1] << 8; // g
-			ground |= p[0];		 // b
-
-			if (ground != labels[k])
-				num++;
-
-			k++;
+			const int x = queue[c] % width;
+			const int y = queue[c] / width;
+			for (int n = 0; n < 4; n++)
+			{
+				const int xx = x + dx4[n];
+				const int yy = y + dy4[n];
+				if (xx < 0 || xx >= width || yy < 0 || yy >= height)
+					continue;
+				const int ni = yy * width + xx;
+				if (!visited[ni] && labels[ni] == label)
+				{
+					visited[ni] = 1;
+					queue[count++] = ni;
+				}
+			}
 		}
 	}
-
-	// ofc, later, you'll have to cleanup
-	delete[] rgb;
-
-	fclose(fp);
-
-	return num;
+	return split;
 }
 
 //===========================================================================
@@ -127,11 +59,13 @@ int CheckLabelswithPPM(char *filename, int *labels, int width, int height)
 //===========================================================================
 int main(int argc, char **argv)
 {
-	unsigned int *img = NULL;
+	void *map = NULL;
+	size_t mapsize = 0;
+	const unsigned char *img = NULL;
 	int width(0);
 	int height(0);
 
-	LoadPPM((char *)"data/case1/input_image.ppm", &img, &width, &height);
+	MapPPM((char *)"data/case1/input_image.ppm", &map, &mapsize, &img, &width, &height);
 	if (width == 0 || height == 0)
 		return -1;
 
@@ -139,13 +73,14 @@ int main(int argc, char **argv)
 	int *labels = new int[sz];
 	int numlabels(0);
 	SLIC slic;
+	slic.SetVerbose(true);
 	int m_spcount;
 	double m_compactness = 10.0;
 
 	// Case 1
 	m_spcount = 200;
 	auto startTime = Clock::now();
-	slic.PerformSLICO_ForGivenK(img, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
+	slic.PerformSLICO_ForGivenK(img, (size_t)width * 3, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
 	auto endTime = Clock::now();
 	auto compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
 	std::cout << "Case 1 Computing time: " << (double)compTime.count() / 1000 << "ms" << std::endl;
@@ -163,12 +98,11 @@ int main(int argc, char **argv)
 	// slic.SaveSuperpixelLabels2PPM((char *)"output_labels.ppm", labels, width, height);
 	if (labels)
 		delete[] labels;
-	if (img)
-		delete[] img;
+	UnmapPPM(map, mapsize);
 
 	// Case 2
 	m_spcount = 400;
-	LoadPPM((char *)"data/case2/input_image.ppm", &img, &width, &height);
+	MapPPM((char *)"data/case2/input_image.ppm", &map, &mapsize, &img, &width, &height);
 	if (width == 0 || height == 0)
 		return -1;
 
@@ -176,7 +110,7 @@ int main(int argc, char **argv)
 	labels = new int[sz];
 
 	startTime = Clock::now();
-	slic.PerformSLICO_ForGivenK(img, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
+	slic.PerformSLICO_ForGivenK(img, (size_t)width * 3, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
 	endTime = Clock::now();
 	compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
 	std::cout << "Case 2 Computing time: " << (double)compTime.count() / 1000 << "ms" << std::endl;
@@ -193,12 +127,11 @@ int main(int argc, char **argv)
 
 	if (labels)
 		delete[] labels;
-	if (img)
-		delete[] img;
+	UnmapPPM(map, mapsize);
 
 	// Case 3
 	m_spcount = 150;
-	LoadPPM((char *)"data/case3/input_image.ppm", &img, &width, &height);
+	MapPPM((char *)"data/case3/input_image.ppm", &map, &mapsize, &img, &width, &height);
 	if (width == 0 || height == 0)
 		return -1;
 
@@ -206,7 +139,7 @@ int main(int argc, char **argv)
 	labels = new int[sz];
 
 	startTime = Clock::now();
-	slic.PerformSLICO_ForGivenK(img, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
+	slic.PerformSLICO_ForGivenK(img, (size_t)width * 3, width, height, labels, numlabels, m_spcount, m_compactness); //for a given number K of superpixels
 	endTime = Clock::now();
 	compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
 	std::cout << "Case 3 Computing time: " << (double)compTime.count() / 1000 << "ms" << std::endl;
@@ -223,8 +156,49 @@ int main(int argc, char **argv)
 
 	if (labels)
 		delete[] labels;
-	if (img)
-		delete[] img;
+
+	// Case 4: PerformSLICO_Incremental on a 1280x720 crop of case 3 with
+	// three textured 120x90 patches moving 70, -20 and 35 pixels per frame; no
+	// label may end up in pieces
+	m_spcount = 1000;
+	const int framewidth = 1280, frameheight = 720, frames = 30;
+	const int speeds[3] = {70, -20, 35};
+	const int spanx = framewidth - 120, spany = frameheight - 90;
+	std::vector<unsigned int> frame(framewidth * frameheight);
+	std::vector<int> framelabels(framewidth * frameheight);
+	SLIC incremental;
+	int split = 0;
+	startTime = Clock::now();
+	for (int t = 0; t < frames; t++)
+	{
+		for (int y = 0; y < frameheight; y++)
+		{
+			for (int x = 0; x < framewidth; x++)
+			{
+				int sx = x + 300, sy = y + 500;
+				for (int k = 0; k < 3; k++)
+				{
+					const int px = ((100 + k * 300 + t * speeds[k]) % spanx + spanx) % spanx;
+					const int py = (100 + k * 150 + t * (k + 1) * 3) % spany;
+					if (x >= px && x < px + 120 && y >= py && y < py + 90)
+					{
+						sx = x - px + 1800 - k * 200;
+						sy = y - py + 2500 - k * 300;
+					}
+				}
+				const unsigned char *p = img + ((size_t)sy * width + sx) * 3;
+				frame[y * framewidth + x] = p[2] << 16 | p[1] << 8 | p[0];
+			}
+		}
+		incremental.PerformSLICO_Incremental(frame.data(), framewidth, frameheight, framelabels.data(), numlabels,
+											 m_spcount, m_compactness, NULL, 8);
+		split += CountSplitLabels(framelabels.data(), framewidth, frameheight, numlabels);
+	}
+	endTime = Clock::now();
+	compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+	std::cout << "Case 4 Computing time: " << (double)compTime.count() / 1000 << "ms" << std::endl;
+	std::cout << "There are " << split << " split labels in " << frames << " incremental frames." << std::endl;
+	UnmapPPM(map, mapsize);
 
 	return 0;
 }
\ No newline at end of file
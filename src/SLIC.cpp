@@ -30,14 +30,21 @@
 #include <chrono>
 #include <immintrin.h>
 #include <cstring>
+#include <cstdlib>
 #include <vector>
-#include <unordered_map>
 #include <map>
-#include <deque>
 #include <omp.h>
 
 typedef std::chrono::high_resolution_clock Clock;
 
+//===========================================================================
+///	ElapsedMs
+//===========================================================================
+static inline double ElapsedMs(const Clock::time_point &start, const Clock::time_point &end)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1e6;
+}
+
 // For superpixels
 const int dx4[4] = {-1, 0, 1, 0};
 const int dy4[4] = {0, -1, 0, 1};
@@ -49,31 +56,754 @@ const int dx10[10] = {-1, 0, 1, 0, -1, 1, 1, -1, 0, 0};
 const int dy10[10] = {0, -1, 0, 1, -1, -1, 1, 1, 0, 0};
 const int dz10[10] = {0, 0, 0, 0, 0, 0, 0, 0, -1, 1};
 
-#if _OPENMP
-struct my_max
+//////////////////////////////////////////////////////////////////////
+// Kernels
+//
+// The hot loops are compiled once per ISA with function target attributes
+// and picked by cpuid the first time they are needed, so one binary runs
+// on any x86-64 and still uses AVX2/AVX-512 where the node has them. The
+// kernels that are not hand written share an always inlined body, which
+// the compiler vectorises separately for each target.
+//////////////////////////////////////////////////////////////////////
+
+// GCC contracts a multiply and an add into an FMA whenever the target has
+// one, which would make the AVX2/AVX-512 variants round differently from
+// the others. Keep every variant uncontracted. Clang and icc have no
+// function attribute for it and are built with -ffp-contract=off and
+// -fp-model precise -no-fma instead (Makefile).
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER)
+#define SLIC_NO_FMA_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define SLIC_NO_FMA_CONTRACT
+#endif
+
+#if defined(__GNUC__)
+#define SLIC_KERNEL_INLINE SLIC_NO_FMA_CONTRACT static inline __attribute__((always_inline))
+#else
+#define SLIC_KERNEL_INLINE static inline
+#endif
+
+//===========================================================================
+///	RGB2LAB_LUT
+///
+///	Per pixel sRGB to CIELAB conversion using the gamma lookup tables.
+/// Shared by every conversion kernel and the 24 bit table so that they stay
+/// identical.
+//===========================================================================
+SLIC_KERNEL_INLINE void RGB2LAB_LUT(
+	const int sR,
+	const int sG,
+	const int sB,
+	const double *rgb_lut,
+	const double *rgb_pow_lut,
+	lab_t &lval,
+	lab_t &aval,
+	lab_t &bval)
+{
+	//------------------------
+	// sRGB to XYZ conversion
+	//------------------------
+	double X, Y, Z;
+	double r, g, b;
+
+	if (sR <= 10.31475)
+		r = rgb_lut[sR];
+	else
+		r = rgb_pow_lut[sR];
+	if (sG <= 10.31475)
+		g = rgb_lut[sG];
+	else
+		g = rgb_pow_lut[sG];
+	if (sB <= 10.31475)
+		b = rgb_lut[sB];
+	else
+		b = rgb_pow_lut[sB];
+
+	X = r * 0.4124564 + g * 0.3575761 + b * 0.1804375;
+	Y = r * 0.2126729 + g * 0.7151522 + b * 0.0721750;
+	Z = r * 0.0193339 + g * 0.1191920 + b * 0.9503041;
+
+	//------------------------
+	// XYZ to LAB conversion
+	//------------------------
+	double epsilon = 0.008856; //actual CIE standard
+	double kappa = 903.3;	   //actual CIE standard
+
+	double Xr = 0.950456; //reference white
+	double Yr = 1.0;	  //reference white
+	double Zr = 1.088754; //reference white
+
+	double xr = X / Xr;
+	double yr = Y / Yr;
+	double zr = Z / Zr;
+
+	double fx, fy, fz;
+	double fx2, fy2, fz2;
+	fx2 = (kappa * xr + 16.0) / 116.0;
+	fy2 = (kappa * yr + 16.0) / 116.0;
+	fz2 = (kappa * zr + 16.0) / 116.0;
+	fx = cbrt(xr);
+	fy = cbrt(yr);
+	fz = cbrt(zr);
+	fx = xr > epsilon ? fx : fx2;
+	fy = yr > epsilon ? fy : fy2;
+	fz = zr > epsilon ? fz : fz2;
+
+	lval = 116.0 * fy - 16.0;
+	aval = 500.0 * (fx - fy);
+	bval = 200.0 * (fy - fz);
+}
+
+//===========================================================================
+///	Pixel rows
+///
+///	The assignment kernels are templated on the pixel layout: planar_row is
+/// the default three Lab planes, packed_row the interleaved lab_pixel array
+/// of SetInterleavedLayout. Both point at the start of one image row.
+//===========================================================================
+struct planar_row
+{
+	const lab_t *l;
+	const lab_t *a;
+	const lab_t *b;
+};
+
+struct packed_row
+{
+	const lab_pixel *p;
+};
+
+SLIC_KERNEL_INLINE void GetLab(const planar_row &row, const int x, lab_t &l, lab_t &a, lab_t &b)
+{
+	l = row.l[x];
+	a = row.a[x];
+	b = row.b[x];
+}
+
+SLIC_KERNEL_INLINE void GetLab(const packed_row &row, const int x, lab_t &l, lab_t &a, lab_t &b)
+{
+	l = row.p[x].l;
+	a = row.p[x].a;
+	b = row.p[x].b;
+}
+
+//===========================================================================
+///	AssignRow
+///
+///	Distance of one seed to pixels [x1, x2) of one row, keeping the nearest
+/// seed in labels/distvec. Row pointers are already offset to the row start.
+/// The SIMD variants evaluate the distance with the same operations in the
+/// same order as the scalar one, without FMA contraction, so they pick the
+/// same labels.
+//===========================================================================
+struct assign_seed
+{
+	lab_t l, a, b;
+	lab_t x;
+	lab_t cons_y; //(y - seed y)^2 for the row
+	lab_t inv_maxlab;
+	lab_t invxywt;
+	int n;
+};
+
+template <class Row>
+SLIC_KERNEL_INLINE void AssignRow_Body(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	for (int x = x1; x < x2; x++)
+	{
+		lab_t l, a, b;
+		GetLab(row, x, l, a, b);
+
+		distlab[x] = (l - seed.l) * (l - seed.l) +
+					 (a - seed.a) * (a - seed.a) +
+					 (b - seed.b) * (b - seed.b);
+		lab_t distxy = (x - seed.x) * (x - seed.x) + seed.cons_y;
+
+		//------------------------------------------------------------------------
+		lab_t dist = distlab[x] * seed.inv_maxlab + distxy * seed.invxywt; //only varying m, prettier superpixels
+		//------------------------------------------------------------------------
+
+		if (dist < distvec[x])
+		{
+			labels[x] = seed.n;
+			distvec[x] = dist;
+		}
+	}
+}
+
+//===========================================================================
+///	AccumulateRow
+///
+///	Adds pixels [x1, x2) of row y to the sums of the clusters they were
+/// assigned to, and raises each cluster's maxlab to the distlab it saw.
+//===========================================================================
+template <class Row>
+SLIC_KERNEL_INLINE void AccumulateRow(
+	const Row &row,
+	const lab_t *distlab,
+	const int *labels,
+	const int x1,
+	const int x2,
+	const int y,
+	cluster_sum *sums)
+{
+	for (int x = x1; x < x2; x++)
+	{
+		//-----------------------------------------------------------------
+		// Assign the max color distance for a cluster
+		//-----------------------------------------------------------------
+		cluster_sum &sum = sums[labels[x]];
+		if (sum.maxlab < distlab[x])
+			sum.maxlab = distlab[x];
+		//-----------------------------------------------------------------
+		// Recalculate the centroid and store in the seed values
+		//-----------------------------------------------------------------
+		lab_t l, a, b;
+		GetLab(row, x, l, a, b);
+		sum.l += l;
+		sum.a += a;
+		sum.b += b;
+		sum.x += x;
+		sum.y += y;
+		sum.count++;
+	}
+}
+
+//===========================================================================
+///	ConvertARGB / ConvertRGB
+///
+///	sRGB to CIELAB for count consecutive pixels, either ARGB words or packed
+/// 3 byte pixels with byte 2 as red. A non-NULL table is the shared 24 bit
+/// table, looked up instead of computing each pixel.
+//===========================================================================
+SLIC_KERNEL_INLINE void ConvertARGB_Body(
+	const unsigned int *ubuff,
+	const int count,
+	const double *lut,
+	const double *pow_lut,
+	const lab_t *table,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec)
+{
+	if (table)
+	{
+#pragma omp simd
+		for (int j = 0; j < count; j++)
+		{
+			const lab_t *entry = table + (size_t)(ubuff[j] & 0xFFFFFF) * 3;
+			lvec[j] = entry[0];
+			avec[j] = entry[1];
+			bvec[j] = entry[2];
+		}
+		return;
+	}
+#pragma omp simd
+	for (int j = 0; j < count; j++)
+	{
+		int sR = (ubuff[j] >> 16) & 0xFF;
+		int sG = (ubuff[j] >> 8) & 0xFF;
+		int sB = (ubuff[j]) & 0xFF;
+
+		RGB2LAB_LUT(sR, sG, sB, lut, pow_lut, lvec[j], avec[j], bvec[j]);
+	}
+}
+
+SLIC_KERNEL_INLINE void ConvertRGB_Body(
+	const unsigned char *rgb,
+	const int count,
+	const double *lut,
+	const double *pow_lut,
+	const lab_t *table,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec)
+{
+	if (table)
+	{
+#pragma omp simd
+		for (int x = 0; x < count; x++)
+		{
+			const unsigned char *p = rgb + x * 3;
+			const lab_t *entry = table + (size_t)(p[2] << 16 | p[1] << 8 | p[0]) * 3;
+			lvec[x] = entry[0];
+			avec[x] = entry[1];
+			bvec[x] = entry[2];
+		}
+		return;
+	}
+#pragma omp simd
+	for (int x = 0; x < count; x++)
+	{
+		const unsigned char *p = rgb + x * 3;
+		RGB2LAB_LUT(p[2], p[1], p[0], lut, pow_lut, lvec[x], avec[x], bvec[x]);
+	}
+}
+
+//===========================================================================
+///	RemapLabels
+///
+///	labels[i] = remap[nlabels[i]], the final gather of the connectivity pass.
+//===========================================================================
+SLIC_KERNEL_INLINE void RemapLabels_Body(
+	const int *remap,
+	const int *nlabels,
+	int *labels,
+	const int count)
+{
+#pragma omp simd
+	for (int i = 0; i < count; i++)
+		labels[i] = remap[nlabels[i]];
+}
+
+typedef void (*assign_row_fn)(
+	const planar_row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed);
+
+typedef void (*assign_packed_fn)(
+	const packed_row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed);
+
+typedef void (*convert_argb_fn)(
+	const unsigned int *ubuff,
+	const int count,
+	const double *lut,
+	const double *pow_lut,
+	const lab_t *table,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec);
+
+typedef void (*convert_rgb_fn)(
+	const unsigned char *rgb,
+	const int count,
+	const double *lut,
+	const double *pow_lut,
+	const lab_t *table,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec);
+
+typedef void (*remap_labels_fn)(
+	const int *remap,
+	const int *nlabels,
+	int *labels,
+	const int count);
+
+// One copy of each inlined body per ISA; TARGET is the function attribute,
+// empty for the baseline the file is compiled for.
+#define SLIC_DEFINE_KERNELS(SUFFIX, TARGET)                                                               \
+	TARGET SLIC_NO_FMA_CONTRACT static void ConvertARGB_##SUFFIX(                                          \
+		const unsigned int *ubuff, const int count, const double *lut, const double *pow_lut,              \
+		const lab_t *table, lab_t *lvec, lab_t *avec, lab_t *bvec)                                         \
+	{                                                                                                      \
+		ConvertARGB_Body(ubuff, count, lut, pow_lut, table, lvec, avec, bvec);                             \
+	}                                                                                                      \
+	TARGET SLIC_NO_FMA_CONTRACT static void ConvertRGB_##SUFFIX(                                           \
+		const unsigned char *rgb, const int count, const double *lut, const double *pow_lut,               \
+		const lab_t *table, lab_t *lvec, lab_t *avec, lab_t *bvec)                                         \
+	{                                                                                                      \
+		ConvertRGB_Body(rgb, count, lut, pow_lut, table, lvec, avec, bvec);                                \
+	}                                                                                                      \
+	TARGET SLIC_NO_FMA_CONTRACT static void RemapLabels_##SUFFIX(                                          \
+		const int *remap, const int *nlabels, int *labels, const int count)                                \
+	{                                                                                                      \
+		RemapLabels_Body(remap, nlabels, labels, count);                                                   \
+	}
+
+SLIC_DEFINE_KERNELS(Generic, )
+
+template <class Row>
+SLIC_NO_FMA_CONTRACT static void AssignRow_Scalar(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	AssignRow_Body(row, distlab, distvec, labels, x1, x2, seed);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SLIC_HAVE_X86_KERNELS 1
+
+SLIC_DEFINE_KERNELS(SSE42, __attribute__((target("sse4.2"))))
+SLIC_DEFINE_KERNELS(AVX2, __attribute__((target("avx2"))))
+SLIC_DEFINE_KERNELS(AVX512, __attribute__((target("avx512f"))))
+
+// No hand written SSE kernel: the common body, vectorised for SSE4.2.
+template <class Row>
+__attribute__((target("sse4.2"))) SLIC_NO_FMA_CONTRACT static void AssignRow_SSE42(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	AssignRow_Body(row, distlab, distvec, labels, x1, x2, seed);
+}
+
+#if defined(SLIC_SINGLE_PRECISION)
+// Lab of the pixels starting at x into one register per channel. The
+// packed versions transpose 4 x 4 blocks of (l, a, b, pad).
+__attribute__((target("avx2"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const planar_row &row, const int x, __m256 &l, __m256 &a, __m256 &b)
+{
+	l = _mm256_loadu_ps(row.l + x);
+	a = _mm256_loadu_ps(row.a + x);
+	b = _mm256_loadu_ps(row.b + x);
+}
+
+__attribute__((target("avx2"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const packed_row &row, const int x, __m256 &l, __m256 &a, __m256 &b)
+{
+	// pixel i in the low lane, pixel i + 4 in the high lane
+	const float *p = &row.p[x].l;
+	__m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 16), 1);
+	__m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 20), 1);
+	__m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 24), 1);
+	__m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 12)), _mm_loadu_ps(p + 28), 1);
+	__m256 t0 = _mm256_unpacklo_ps(r0, r1); // l0 l1 a0 a1
+	__m256 t1 = _mm256_unpacklo_ps(r2, r3); // l2 l3 a2 a3
+	__m256 t2 = _mm256_unpackhi_ps(r0, r1); // b0 b1 .. ..
+	__m256 t3 = _mm256_unpackhi_ps(r2, r3); // b2 b3 .. ..
+	l = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+	a = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+	b = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+__attribute__((target("avx512f"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const planar_row &row, const int x, __m512 &l, __m512 &a, __m512 &b)
+{
+	l = _mm512_loadu_ps(row.l + x);
+	a = _mm512_loadu_ps(row.a + x);
+	b = _mm512_loadu_ps(row.b + x);
+}
+
+__attribute__((target("avx512f"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const packed_row &row, const int x, __m512 &l, __m512 &a, __m512 &b)
+{
+	// Lane j of register k holds pixel 4k + j. Two source permutes gather the
+	// l and a of eight pixels, then the b, and a last one joins the halves.
+	// (Not the unpacks and shuffles: GCC's pass an undefined vector, which
+	// -Wall flags.)
+	const float *p = &row.p[x].l;
+	const __m512i laorder = _mm512_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28, 1, 5, 9, 13, 17, 21, 25, 29);
+	const __m512i border = _mm512_setr_epi32(2, 6, 10, 14, 18, 22, 26, 30, 3, 7, 11, 15, 19, 23, 27, 31);
+	const __m512i loorder = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, 22, 23);
+	const __m512i hiorder = _mm512_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15, 24, 25, 26, 27, 28, 29, 30, 31);
+	__m512 r0 = _mm512_loadu_ps(p);
+	__m512 r1 = _mm512_loadu_ps(p + 16);
+	__m512 r2 = _mm512_loadu_ps(p + 32);
+	__m512 r3 = _mm512_loadu_ps(p + 48);
+	__m512 t0 = _mm512_permutex2var_ps(r0, laorder, r1); // l0..l7 a0..a7
+	__m512 t1 = _mm512_permutex2var_ps(r2, laorder, r3); // l8..l15 a8..a15
+	__m512 t2 = _mm512_permutex2var_ps(r0, border, r1);  // b0..b7 ..
+	__m512 t3 = _mm512_permutex2var_ps(r2, border, r3);  // b8..b15 ..
+	l = _mm512_permutex2var_ps(t0, loorder, t1);
+	a = _mm512_permutex2var_ps(t0, hiorder, t1);
+	b = _mm512_permutex2var_ps(t2, loorder, t3);
+}
+
+template <class Row>
+__attribute__((target("avx2"))) SLIC_NO_FMA_CONTRACT static void AssignRow_AVX2(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	const __m256 sl = _mm256_set1_ps(seed.l);
+	const __m256 sa = _mm256_set1_ps(seed.a);
+	const __m256 sb = _mm256_set1_ps(seed.b);
+	const __m256 sx = _mm256_set1_ps(seed.x);
+	const __m256 cy = _mm256_set1_ps(seed.cons_y);
+	const __m256 im = _mm256_set1_ps(seed.inv_maxlab);
+	const __m256 iw = _mm256_set1_ps(seed.invxywt);
+	const __m256 step = _mm256_set1_ps(8);
+	const __m256i nv = _mm256_set1_epi32(seed.n);
+	__m256 xv = _mm256_add_ps(_mm256_set1_ps(x1), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+
+	int x = x1;
+	for (; x + 8 <= x2; x += 8)
+	{
+		__m256 l, a, b;
+		LoadLab(row, x, l, a, b);
+		__m256 dl = _mm256_sub_ps(l, sl);
+		__m256 da = _mm256_sub_ps(a, sa);
+		__m256 db = _mm256_sub_ps(b, sb);
+		__m256 dlab = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dl, dl), _mm256_mul_ps(da, da)), _mm256_mul_ps(db, db));
+		_mm256_storeu_ps(distlab + x, dlab);
+
+		__m256 dx = _mm256_sub_ps(xv, sx);
+		__m256 dxy = _mm256_add_ps(_mm256_mul_ps(dx, dx), cy);
+		__m256 dist = _mm256_add_ps(_mm256_mul_ps(dlab, im), _mm256_mul_ps(dxy, iw));
+
+		__m256 dv = _mm256_loadu_ps(distvec + x);
+		__m256 lt = _mm256_cmp_ps(dist, dv, _CMP_LT_OQ);
+		_mm256_storeu_ps(distvec + x, _mm256_blendv_ps(dv, dist, lt));
+		_mm256_maskstore_epi32(labels + x, _mm256_castps_si256(lt), nv);
+		xv = _mm256_add_ps(xv, step);
+	}
+	AssignRow_Scalar(row, distlab, distvec, labels, x, x2, seed);
+}
+
+template <class Row>
+__attribute__((target("avx512f"))) SLIC_NO_FMA_CONTRACT static void AssignRow_AVX512(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	const __m512 sl = _mm512_set1_ps(seed.l);
+	const __m512 sa = _mm512_set1_ps(seed.a);
+	const __m512 sb = _mm512_set1_ps(seed.b);
+	const __m512 sx = _mm512_set1_ps(seed.x);
+	const __m512 cy = _mm512_set1_ps(seed.cons_y);
+	const __m512 im = _mm512_set1_ps(seed.inv_maxlab);
+	const __m512 iw = _mm512_set1_ps(seed.invxywt);
+	const __m512 step = _mm512_set1_ps(16);
+	const __m512i nv = _mm512_set1_epi32(seed.n);
+	__m512 xv = _mm512_add_ps(_mm512_set1_ps(x1), _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+
+	int x = x1;
+	for (; x + 16 <= x2; x += 16)
+	{
+		__m512 l, a, b;
+		LoadLab(row, x, l, a, b);
+		__m512 dl = _mm512_sub_ps(l, sl);
+		__m512 da = _mm512_sub_ps(a, sa);
+		__m512 db = _mm512_sub_ps(b, sb);
+		__m512 dlab = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dl, dl), _mm512_mul_ps(da, da)), _mm512_mul_ps(db, db));
+		_mm512_storeu_ps(distlab + x, dlab);
+
+		__m512 dx = _mm512_sub_ps(xv, sx);
+		__m512 dxy = _mm512_add_ps(_mm512_mul_ps(dx, dx), cy);
+		__m512 dist = _mm512_add_ps(_mm512_mul_ps(dlab, im), _mm512_mul_ps(dxy, iw));
+
+		__mmask16 lt = _mm512_cmp_ps_mask(dist, _mm512_loadu_ps(distvec + x), _CMP_LT_OQ);
+		_mm512_mask_storeu_ps(distvec + x, lt, dist);
+		_mm512_mask_storeu_epi32(labels + x, lt, nv);
+		xv = _mm512_add_ps(xv, step);
+	}
+	AssignRow_Scalar(row, distlab, distvec, labels, x, x2, seed);
+}
+#else
+// Lab of the pixels starting at x into one register per channel. The
+// packed versions transpose blocks of (l, a, b, pad).
+__attribute__((target("avx2"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const planar_row &row, const int x, __m256d &l, __m256d &a, __m256d &b)
+{
+	l = _mm256_loadu_pd(row.l + x);
+	a = _mm256_loadu_pd(row.a + x);
+	b = _mm256_loadu_pd(row.b + x);
+}
+
+__attribute__((target("avx2"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const packed_row &row, const int x, __m256d &l, __m256d &a, __m256d &b)
+{
+	const double *p = &row.p[x].l;
+	__m256d r0 = _mm256_loadu_pd(p);
+	__m256d r1 = _mm256_loadu_pd(p + 4);
+	__m256d r2 = _mm256_loadu_pd(p + 8);
+	__m256d r3 = _mm256_loadu_pd(p + 12);
+	__m256d t0 = _mm256_unpacklo_pd(r0, r1); // l0 l1 b0 b1
+	__m256d t1 = _mm256_unpackhi_pd(r0, r1); // a0 a1 .. ..
+	__m256d t2 = _mm256_unpacklo_pd(r2, r3); // l2 l3 b2 b3
+	__m256d t3 = _mm256_unpackhi_pd(r2, r3); // a2 a3 .. ..
+	l = _mm256_permute2f128_pd(t0, t2, 0x20);
+	a = _mm256_permute2f128_pd(t1, t3, 0x20);
+	b = _mm256_permute2f128_pd(t0, t2, 0x31);
+}
+
+__attribute__((target("avx512f"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const planar_row &row, const int x, __m512d &l, __m512d &a, __m512d &b)
+{
+	l = _mm512_loadu_pd(row.l + x);
+	a = _mm512_loadu_pd(row.a + x);
+	b = _mm512_loadu_pd(row.b + x);
+}
+
+__attribute__((target("avx512f"), always_inline)) SLIC_NO_FMA_CONTRACT static inline void LoadLab(const packed_row &row, const int x, __m512d &l, __m512d &a, __m512d &b)
+{
+	// Register k holds pixels 2k and 2k + 1. Two source permutes gather the
+	// l and a of four pixels, then the b, and a last one joins the halves.
+	// (Not the unpacks: GCC's pass an undefined vector, which -Wall flags.)
+	const double *p = &row.p[x].l;
+	const __m512i laorder = _mm512_setr_epi64(0, 4, 8, 12, 1, 5, 9, 13);
+	const __m512i border = _mm512_setr_epi64(2, 6, 10, 14, 3, 7, 11, 15);
+	const __m512i loorder = _mm512_setr_epi64(0, 1, 2, 3, 8, 9, 10, 11);
+	const __m512i hiorder = _mm512_setr_epi64(4, 5, 6, 7, 12, 13, 14, 15);
+	__m512d r0 = _mm512_loadu_pd(p);
+	__m512d r1 = _mm512_loadu_pd(p + 8);
+	__m512d r2 = _mm512_loadu_pd(p + 16);
+	__m512d r3 = _mm512_loadu_pd(p + 24);
+	__m512d t0 = _mm512_permutex2var_pd(r0, laorder, r1); // l0 l1 l2 l3 a0 a1 a2 a3
+	__m512d t1 = _mm512_permutex2var_pd(r2, laorder, r3); // l4 l5 l6 l7 a4 a5 a6 a7
+	__m512d t2 = _mm512_permutex2var_pd(r0, border, r1);  // b0 b1 b2 b3 .. .. .. ..
+	__m512d t3 = _mm512_permutex2var_pd(r2, border, r3);  // b4 b5 b6 b7 .. .. .. ..
+	l = _mm512_permutex2var_pd(t0, loorder, t1);
+	a = _mm512_permutex2var_pd(t0, hiorder, t1);
+	b = _mm512_permutex2var_pd(t2, loorder, t3);
+}
+
+template <class Row>
+__attribute__((target("avx2"))) SLIC_NO_FMA_CONTRACT static void AssignRow_AVX2(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
+{
+	const __m256d sl = _mm256_set1_pd(seed.l);
+	const __m256d sa = _mm256_set1_pd(seed.a);
+	const __m256d sb = _mm256_set1_pd(seed.b);
+	const __m256d sx = _mm256_set1_pd(seed.x);
+	const __m256d cy = _mm256_set1_pd(seed.cons_y);
+	const __m256d im = _mm256_set1_pd(seed.inv_maxlab);
+	const __m256d iw = _mm256_set1_pd(seed.invxywt);
+	const __m256d step = _mm256_set1_pd(4);
+	const __m128i nv = _mm_set1_epi32(seed.n);
+	// picks the low dword of each 64 bit compare lane
+	const __m256i lanes = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256d xv = _mm256_add_pd(_mm256_set1_pd(x1), _mm256_setr_pd(0, 1, 2, 3));
+
+	int x = x1;
+	for (; x + 4 <= x2; x += 4)
+	{
+		__m256d l, a, b;
+		LoadLab(row, x, l, a, b);
+		__m256d dl = _mm256_sub_pd(l, sl);
+		__m256d da = _mm256_sub_pd(a, sa);
+		__m256d db = _mm256_sub_pd(b, sb);
+		__m256d dlab = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dl, dl), _mm256_mul_pd(da, da)), _mm256_mul_pd(db, db));
+		_mm256_storeu_pd(distlab + x, dlab);
+
+		__m256d dx = _mm256_sub_pd(xv, sx);
+		__m256d dxy = _mm256_add_pd(_mm256_mul_pd(dx, dx), cy);
+		__m256d dist = _mm256_add_pd(_mm256_mul_pd(dlab, im), _mm256_mul_pd(dxy, iw));
+
+		__m256d dv = _mm256_loadu_pd(distvec + x);
+		__m256d lt = _mm256_cmp_pd(dist, dv, _CMP_LT_OQ);
+		_mm256_storeu_pd(distvec + x, _mm256_blendv_pd(dv, dist, lt));
+		__m128i lt32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(lt), lanes));
+		_mm_maskstore_epi32(labels + x, lt32, nv);
+		xv = _mm256_add_pd(xv, step);
+	}
+	AssignRow_Scalar(row, distlab, distvec, labels, x, x2, seed);
+}
+
+template <class Row>
+__attribute__((target("avx512f"))) SLIC_NO_FMA_CONTRACT static void AssignRow_AVX512(
+	const Row &row,
+	lab_t *distlab,
+	lab_t *distvec,
+	int *labels,
+	const int x1,
+	const int x2,
+	const assign_seed &seed)
 {
-	template <class T>
-	const T &operator()(const T &a, const T &b) const
+	const __m512d sl = _mm512_set1_pd(seed.l);
+	const __m512d sa = _mm512_set1_pd(seed.a);
+	const __m512d sb = _mm512_set1_pd(seed.b);
+	const __m512d sx = _mm512_set1_pd(seed.x);
+	const __m512d cy = _mm512_set1_pd(seed.cons_y);
+	const __m512d im = _mm512_set1_pd(seed.inv_maxlab);
+	const __m512d iw = _mm512_set1_pd(seed.invxywt);
+	const __m512d step = _mm512_set1_pd(8);
+	const __m512i nv = _mm512_set1_epi32(seed.n);
+	__m512d xv = _mm512_add_pd(_mm512_set1_pd(x1), _mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7));
+
+	int x = x1;
+	for (; x + 8 <= x2; x += 8)
 	{
-		return std::max(a, b);
+		__m512d l, a, b;
+		LoadLab(row, x, l, a, b);
+		__m512d dl = _mm512_sub_pd(l, sl);
+		__m512d da = _mm512_sub_pd(a, sa);
+		__m512d db = _mm512_sub_pd(b, sb);
+		__m512d dlab = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dl, dl), _mm512_mul_pd(da, da)), _mm512_mul_pd(db, db));
+		_mm512_storeu_pd(distlab + x, dlab);
+
+		__m512d dx = _mm512_sub_pd(xv, sx);
+		__m512d dxy = _mm512_add_pd(_mm512_mul_pd(dx, dx), cy);
+		__m512d dist = _mm512_add_pd(_mm512_mul_pd(dlab, im), _mm512_mul_pd(dxy, iw));
+
+		__mmask8 lt = _mm512_cmp_pd_mask(dist, _mm512_loadu_pd(distvec + x), _CMP_LT_OQ);
+		_mm512_mask_storeu_pd(distvec + x, lt, dist);
+		// only the low 8 of the 16 dword lanes can be set
+		_mm512_mask_storeu_epi32(labels + x, (__mmask16)lt, nv);
+		xv = _mm512_add_pd(xv, step);
 	}
+	AssignRow_Scalar(row, distlab, distvec, labels, x, x2, seed);
+}
+#endif
+#endif
+
+struct isa_kernels
+{
+	const char *isa;
+	assign_row_fn assign_row;
+	assign_packed_fn assign_packed;
+	convert_argb_fn convert_argb;
+	convert_rgb_fn convert_rgb;
+	remap_labels_fn remap_labels;
 };
-#pragma omp declare reduction(vec_double_sum                                                                                           \
-							  : std::vector <double>                                                                                   \
-							  : std::transform(omp_out.begin(), omp_out.end(), omp_in.begin(), omp_out.begin(), std::plus <double>())) \
-	initializer(omp_priv = decltype(omp_orig)(omp_orig.size()))
-#pragma omp declare reduction(vec_double_max                                                                               \
-							  : std::vector <double>                                                                       \
-							  : std::transform(omp_out.begin(), omp_out.end(), omp_in.begin(), omp_out.begin(), my_max())) \
-	initializer(omp_priv = decltype(omp_orig)(omp_orig.size()))
-#pragma omp declare reduction(vec_int_sum                                                                                           \
-							  : std::vector <int>                                                                                   \
-							  : std::transform(omp_out.begin(), omp_out.end(), omp_in.begin(), omp_out.begin(), std::plus <int>())) \
-	initializer(omp_priv = decltype(omp_orig)(omp_orig.size()))
-#pragma omp declare reduction(merge                     \
-							  : std::vector <area_info> \
-							  : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
+
+//===========================================================================
+///	SelectKernels
+///
+///	Best variant the CPU supports. SLIC_ISA=generic|sse4.2|avx2|avx512 in
+/// the environment caps the choice, e.g. to compare variants on one node.
+//===========================================================================
+static isa_kernels SelectKernels()
+{
+	static const isa_kernels generic = {"generic", AssignRow_Scalar<planar_row>, AssignRow_Scalar<packed_row>, ConvertARGB_Generic, ConvertRGB_Generic, RemapLabels_Generic};
+	const char *cap = getenv("SLIC_ISA");
+	const string limit = cap ? cap : "";
+#if SLIC_HAVE_X86_KERNELS
+	static const isa_kernels sse42 = {"sse4.2", AssignRow_SSE42<planar_row>, AssignRow_SSE42<packed_row>, ConvertARGB_SSE42, ConvertRGB_SSE42, RemapLabels_SSE42};
+	static const isa_kernels avx2 = {"avx2", AssignRow_AVX2<planar_row>, AssignRow_AVX2<packed_row>, ConvertARGB_AVX2, ConvertRGB_AVX2, RemapLabels_AVX2};
+	static const isa_kernels avx512 = {"avx512", AssignRow_AVX512<planar_row>, AssignRow_AVX512<packed_row>, ConvertARGB_AVX512, ConvertRGB_AVX512, RemapLabels_AVX512};
+
+	__builtin_cpu_init();
+	const bool any = limit.empty();
+	if ((any || limit == "avx512") && __builtin_cpu_supports("avx512f"))
+		return avx512;
+	if ((any || limit == "avx512" || limit == "avx2") && __builtin_cpu_supports("avx2"))
+		return avx2;
+	if (limit != "generic" && __builtin_cpu_supports("sse4.2"))
+		return sse42;
 #endif
+	return generic;
+}
+
+static const isa_kernels &Kernels()
+{
+	static const isa_kernels kernels = SelectKernels();
+	return kernels;
+}
 
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
@@ -81,13 +811,38 @@ struct my_max
 
 SLIC::SLIC()
 {
+	m_use_lab_table = false;
+	m_tiled = false;
+	m_interleaved = false;
+	m_batch_threshold = 1 << 20;
+	m_threshold = 0;
+	m_maxitr = 10;
+	m_warm = false;
+	m_warm_threshold = 0;
+	m_incremental_threshold = 0;
+	m_warm_width = m_warm_height = m_warm_K = 0;
+	m_keep_rawlabels = false;
+	m_verbose = false;
+
 	m_lvec = NULL;
 	m_avec = NULL;
 	m_bvec = NULL;
+	m_distlab = NULL;
+	m_distvec = NULL;
+	m_workspace_size = 0;
+	m_distrows_size = 0;
+	m_labxy = NULL;
+	m_labxy_size = 0;
+	m_labxy_packed = false;
 
 	m_lvecvec = NULL;
 	m_avecvec = NULL;
 	m_bvecvec = NULL;
+	m_depth = 0;
+	m_slice_size = 0;
+
+	m_clustersums = NULL;
+	m_clustersums_size = 0;
 }
 
 SLIC::~SLIC()
@@ -98,6 +853,16 @@ SLIC::~SLIC()
 		delete[] m_avec;
 	if (m_bvec)
 		delete[] m_bvec;
+	if (m_distlab)
+		delete[] m_distlab;
+	if (m_distvec)
+		delete[] m_distvec;
+	if (m_clustersums)
+		_mm_free(m_clustersums);
+	if (m_labxy)
+		_mm_free(m_labxy);
+	for (size_t w = 0; w < m_workers.size(); w++)
+		delete m_workers[w];
 
 	if (m_lvecvec)
 	{
@@ -205,106 +970,252 @@ void SLIC::RGB2LAB(const int &sR, const int &sG, const int &sB, double &lval, do
 }
 
 //===========================================================================
-///	DoRGBtoLABConversion
+///	GetRGBtoLABTable
 ///
-///	For whole image: overlaoded floating point version
+///	Full 24 bit sRGB to CIELAB table, indexed by 0xRRGGBB with L, a and b
+/// interleaved. Built on first use and shared by every SLIC instance for the
+/// rest of the process: 16M entries, i.e. 384 MB in double, 192 MB in float.
+/// The entries come from RGB2LAB_LUT, so the table gives the same planes as
+/// the direct conversion.
 //===========================================================================
-void SLIC::DoRGBtoLABConversion(
-	const unsigned int *&ubuff,
-	double *&lvec,
-	double *&avec,
-	double *&bvec)
+const lab_t *SLIC::GetRGBtoLABTable()
 {
-	int sz = m_width * m_height;
-	lvec = new double[sz];
-	avec = new double[sz];
-	bvec = new double[sz];
-// #pragma prefetch rgb_lut : 2 : 256
-// #pragma prefetch rgb_pow_lut : 2 : 256
-// #pragma prefetch ubuff : 1 : 16
-#if _OPENMP
-#pragma omp parallel for simd
-#endif
-	for (int j = 0; j < sz; j++)
-	{
-		int sR = (ubuff[j] >> 16) & 0xFF;
-		int sG = (ubuff[j] >> 8) & 0xFF;
-		int sB = (ubuff[j]) & 0xFF;
-
-		//------------------------
-		// sRGB to XYZ conversion
-		//------------------------
-		double X, Y, Z;
-		// double R = sR / 255.0;
-		// double G = sG / 255.0;
-		// double B = sB / 255.0;
-
-		double r, g, b;
-
-		if (sR <= 10.31475)
-			r = rgb_lut[sR];
-		else
-			r = rgb_pow_lut[sR];
-		if (sG <= 10.31475)
-			g = rgb_lut[sG];
-		else
-			g = rgb_pow_lut[sG];
-		if (sB <= 10.31475)
-			b = rgb_lut[sB];
-		else
-			b = rgb_pow_lut[sB];
-
-		X = r * 0.4124564 + g * 0.3575761 + b * 0.1804375;
-		Y = r * 0.2126729 + g * 0.7151522 + b * 0.0721750;
-		Z = r * 0.0193339 + g * 0.1191920 + b * 0.9503041;
-
-		//------------------------
-		// XYZ to LAB conversion
-		//------------------------
-		double epsilon = 0.008856; //actual CIE standard
-		double kappa = 903.3;	   //actual CIE standard
-
-		double Xr = 0.950456; //reference white
-		double Yr = 1.0;	  //reference white
-		double Zr = 1.088754; //reference white
+	static const lab_t *table = BuildRGBtoLABTable();
+	return table;
+}
 
-		double xr = X / Xr;
-		double yr = Y / Yr;
-		double zr = Z / Zr;
+lab_t *SLIC::BuildRGBtoLABTable()
+{
+	const int size = 1 << 24;
+	lab_t *table = new lab_t[(size_t)size * 3];
 
-		double fx, fy, fz;
-		double fx2, fy2, fz2;
-		fx2 = (kappa * xr + 16.0) / 116.0;
-		fy2 = (kappa * yr + 16.0) / 116.0;
-		fz2 = (kappa * zr + 16.0) / 116.0;
-		fx = cbrt(xr);
-		fy = cbrt(yr);
-		fz = cbrt(zr);
-		fx = xr > epsilon ? fx : fx2;
-		fy = yr > epsilon ? fy : fy2;
-		fz = zr > epsilon ? fz : fz2;
+	double lut[256];
+	double pow_lut[256];
+	for (int i = 0; i < 256; i++)
+	{
+		double tmp = i / 255.0;
+		lut[i] = tmp / 12.92;
+		pow_lut[i] = pow((tmp + 0.055) / 1.055, 2.4);
+	}
 
-		lvec[j] = 116.0 * fy - 16.0;
-		avec[j] = 500.0 * (fx - fy);
-		bvec[j] = 200.0 * (fy - fz);
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int rg = 0; rg < (1 << 16); rg++)
+	{
+		const int sR = rg >> 8;
+		const int sG = rg & 0xFF;
+		lab_t *entry = table + (size_t)rg * 256 * 3;
+#pragma omp simd
+		for (int sB = 0; sB < 256; sB++)
+		{
+			RGB2LAB_LUT(sR, sG, sB, lut, pow_lut, entry[sB * 3], entry[sB * 3 + 1], entry[sB * 3 + 2]);
+		}
 	}
+	return table;
 }
 
-//==============================================================================
-///	DetectLabEdges
-//==============================================================================
-void SLIC::DetectLabEdges(
-	const double *lvec,
-	const double *avec,
-	const double *bvec,
-	const int &width,
-	const int &height,
-	vector<double> &edges)
+//===========================================================================
+///	SetRGBtoLABTable
+///
+///	Opt in to converting through the shared 24 bit table. Worth it when the
+/// process converts many more pixels than the 16M it takes to build.
+//===========================================================================
+void SLIC::SetRGBtoLABTable(const bool &enable)
 {
-	int sz = width * height;
+	m_use_lab_table = enable;
+}
 
-	edges.resize(sz);
-#pragma omp parallel for simd
+//===========================================================================
+///	SetTiledAssignment
+///
+///	Opt in to the tiled assignment schedule, see
+/// PerformSuperpixelSegmentation_VariableSandM.
+//===========================================================================
+void SLIC::SetTiledAssignment(const bool &enable)
+{
+	m_tiled = enable;
+}
+
+//===========================================================================
+///	SetInterleavedLayout
+///
+///	Opt in to the lab_pixel layout for the assignment, see PackLabPixels.
+//===========================================================================
+void SLIC::SetInterleavedLayout(const bool &enable)
+{
+	m_interleaved = enable;
+}
+
+//===========================================================================
+///	SetConvergence
+///
+///	Iterate until the mean centroid displacement E, measured in grid steps
+/// S, falls below threshold, at most maxitr times. threshold <= 0 always runs maxitr
+/// iterations; the default, 10 fixed iterations, is what check.ppm was
+/// produced with.
+//===========================================================================
+void SLIC::SetConvergence(const double &threshold, const int &maxitr)
+{
+	m_threshold = threshold;
+	m_maxitr = max(1, maxitr);
+}
+
+//===========================================================================
+///	SetWarmStart
+///
+///	Opt in to seeding each frame from the previous one, see PerformSLICO_OnLAB.
+/// Consecutive video frames move the centroids by a fraction of S, so a few
+/// iterations from where the last frame converged replace the full run from
+/// the grid.
+//===========================================================================
+void SLIC::SetWarmStart(const bool &enable, const double &threshold)
+{
+	m_warm = enable;
+	m_warm_threshold = threshold;
+}
+
+//===========================================================================
+///	SetIncrementalConvergence
+///
+///	Threshold on E for the seeds PerformSLICO_Incremental moves. Kept apart
+/// from the warm start one: an incremental stream need not enable warm
+/// starts for its full runs.
+//===========================================================================
+void SLIC::SetIncrementalConvergence(const double &threshold)
+{
+	m_incremental_threshold = threshold;
+}
+
+int SLIC::GetIterationCount() const
+{
+	return m_stats.iterations;
+}
+
+double SLIC::GetResidualError() const
+{
+	return m_stats.residual;
+}
+
+//===========================================================================
+///	SetVerbose / GetStats
+///
+///	Timings are always recorded in GetStats(); SetVerbose(true) also prints
+/// them to std::cout after each run, outside the timed regions.
+//===========================================================================
+void SLIC::SetVerbose(const bool &verbose)
+{
+	m_verbose = verbose;
+}
+
+const SLIC::Stats &SLIC::GetStats() const
+{
+	return m_stats;
+}
+
+//===========================================================================
+///	DoRGBtoLABConversion
+///
+///	For whole image: overlaoded floating point version
+//===========================================================================
+void SLIC::DoRGBtoLABConversion(
+	const unsigned int *ubuff,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec)
+{
+	const convert_argb_fn convert = Kernels().convert_argb;
+	const double *lut = rgb_lut;
+	const double *pow_lut = rgb_pow_lut;
+	const lab_t *table = m_use_lab_table ? GetRGBtoLABTable() : NULL;
+	const int width = m_width;
+
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int y = 0; y < m_height; y++)
+	{
+		const size_t row = (size_t)y * width;
+		convert(ubuff + row, width, lut, pow_lut, table, lvec + row, avec + row, bvec + row);
+	}
+}
+
+//===========================================================================
+///	DoRGBtoLABConversion
+///
+///	For whole image: packed 24 bit version, read in place.
+/// Byte 2 of each pixel is the one the ARGB version finds in bits 16..23,
+/// so a P6 payload gives the same Lab planes as LoadPPM followed by the
+/// ARGB version, without the intermediate 32 bit copy.
+//===========================================================================
+void SLIC::DoRGBtoLABConversion(
+	const unsigned char *rgb,
+	const size_t &stride,
+	lab_t *lvec,
+	lab_t *avec,
+	lab_t *bvec)
+{
+	const convert_rgb_fn convert = Kernels().convert_rgb;
+	const double *lut = rgb_lut;
+	const double *pow_lut = rgb_pow_lut;
+	const lab_t *table = m_use_lab_table ? GetRGBtoLABTable() : NULL;
+	const int width = m_width;
+
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int y = 0; y < m_height; y++)
+	{
+		const size_t row = (size_t)y * width;
+		convert(rgb + y * stride, width, lut, pow_lut, table, lvec + row, avec + row, bvec + row);
+	}
+}
+
+//===========================================================================
+///	DoRGBtoLABConversion
+///
+///	For a volume: depth slices of ARGB pixels into the Lab slices.
+//===========================================================================
+void SLIC::DoRGBtoLABConversion(
+	const unsigned int **ubuffvec,
+	lab_t **lvecvec,
+	lab_t **avecvec,
+	lab_t **bvecvec)
+{
+	const convert_argb_fn convert = Kernels().convert_argb;
+	const double *lut = rgb_lut;
+	const double *pow_lut = rgb_pow_lut;
+	const lab_t *table = m_use_lab_table ? GetRGBtoLABTable() : NULL;
+	const int width = m_width;
+	const int height = m_height;
+	const int rows = m_depth * height;
+
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int r = 0; r < rows; r++)
+	{
+		const int d = r / height;
+		const size_t row = (size_t)(r % height) * width;
+		convert(ubuffvec[d] + row, width, lut, pow_lut, table, lvecvec[d] + row, avecvec[d] + row, bvecvec[d] + row);
+	}
+}
+
+//==============================================================================
+///	DetectLabEdges
+//==============================================================================
+void SLIC::DetectLabEdges(
+	const lab_t *lvec,
+	const lab_t *avec,
+	const lab_t *bvec,
+	const int &width,
+	const int &height,
+	vector<double> &edges)
+{
+	int sz = width * height;
+
+	edges.resize(sz);
+#pragma omp parallel for simd
 	for (int j = 1; j < height - 1; j++)
 	{
 		for (int k = 1; k < width - 1; k++)
@@ -324,14 +1235,20 @@ void SLIC::DetectLabEdges(
 		}
 	}
 }
-double SLIC::DetectLABPixelEdge(
-	const int &i)
-{
-	const double *lvec = m_lvec;
-	const double *avec = m_avec;
-	const double *bvec = m_bvec;
-	const int width = m_width;
 
+//==============================================================================
+///	DetectLABPixelEdge
+///
+///	The entry DetectLabEdges would compute for pixel i, on demand: pixels on
+/// the image border have no edge, which also keeps the stencil in bounds.
+//==============================================================================
+static inline double LabPixelEdge(
+	const lab_t *lvec,
+	const lab_t *avec,
+	const lab_t *bvec,
+	const int &i,
+	const int &width)
+{
 	double dx = (lvec[i - 1] - lvec[i + 1]) * (lvec[i - 1] - lvec[i + 1]) +
 				(avec[i - 1] - avec[i + 1]) * (avec[i - 1] - avec[i + 1]) +
 				(bvec[i - 1] - bvec[i + 1]) * (bvec[i - 1] - bvec[i + 1]);
@@ -342,8 +1259,22 @@ double SLIC::DetectLABPixelEdge(
 	return dx + dy;
 }
 
+double SLIC::DetectLABPixelEdge(
+	const int &i)
+{
+	const int x = i % m_width;
+	const int y = i / m_width;
+	if (x == 0 || x == m_width - 1 || y == 0 || y == m_height - 1)
+		return 0;
+	return LabPixelEdge(m_lvec, m_avec, m_bvec, i, m_width);
+}
+
 //===========================================================================
 ///	PerturbSeeds
+///
+///	Without a precomputed edge map (edges empty), only the 3 x 3
+/// neighbourhood of each seed is evaluated, every pixel once: 9 gradients
+/// per seed instead of a full image pass.
 //===========================================================================
 void SLIC::PerturbSeeds(
 	vector<double> &kseedsl,
@@ -357,7 +1288,12 @@ void SLIC::PerturbSeeds(
 	const int dy8[8] = {0, -1, -1, -1, 0, 1, 1, 1};
 
 	int numseeds = kseedsl.size();
+	const bool lazy = edges.empty();
 
+	// Each seed only reads the Lab planes and writes its own entries
+#if _OPENMP
+#pragma omp parallel for
+#endif
 	for (int n = 0; n < numseeds; n++)
 	{
 		int ox = kseedsx[n]; //original x
@@ -365,6 +1301,7 @@ void SLIC::PerturbSeeds(
 		int oind = oy * m_width + ox;
 
 		int storeind = oind;
+		double storeedge = lazy ? DetectLABPixelEdge(oind) : edges[oind];
 		for (int i = 0; i < 8; i++)
 		{
 			int nx = ox + dx8[i]; //new x
@@ -373,9 +1310,11 @@ void SLIC::PerturbSeeds(
 			if (nx >= 0 && nx < m_width && ny >= 0 && ny < m_height)
 			{
 				int nind = ny * m_width + nx;
-				if (DetectLABPixelEdge(nind) < DetectLABPixelEdge(storeind))
+				double nedge = lazy ? DetectLABPixelEdge(nind) : edges[nind];
+				if (nedge < storeedge)
 				{
 					storeind = nind;
+					storeedge = nedge;
 				}
 			}
 		}
@@ -411,38 +1350,55 @@ void SLIC::GetLABXYSeeds_ForGivenK(
 	int xoff = step / 2;
 	int yoff = step / 2;
 
-	int n(0);
-	int r(0);
+	//--------------------------------------------------
+	// Count the seeds of each hex grid row first, so the rows can be filled
+	// in parallel at their final positions, in the same order as before.
+	//--------------------------------------------------
+	vector<int> &rowstart = m_seedrows;
+	rowstart.assign(1, 0);
 	for (int y = 0; y < m_height; y++)
 	{
 		int Y = y * step + yoff;
 		if (Y > m_height - 1)
 			break;
 
+		int count = 0;
 		for (int x = 0; x < m_width; x++)
 		{
-			//int X = x*step + xoff;//square grid
-			int X = x * step + (xoff << (r & 0x1)); //hex grid
+			int X = x * step + (xoff << (y & 0x1)); //hex grid
 			if (X > m_width - 1)
 				break;
+			count++;
+		}
+		rowstart.push_back(rowstart.back() + count);
+	}
+	const int numrows = rowstart.size() - 1;
+	const int numseeds = rowstart[numrows];
+	kseedsl.resize(numseeds);
+	kseedsa.resize(numseeds);
+	kseedsb.resize(numseeds);
+	kseedsx.resize(numseeds);
+	kseedsy.resize(numseeds);
 
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int r = 0; r < numrows; r++)
+	{
+		int Y = r * step + yoff;
+		for (int n = rowstart[r]; n < rowstart[r + 1]; n++)
+		{
+			const int x = n - rowstart[r];
+			//int X = x*step + xoff;//square grid
+			int X = x * step + (xoff << (r & 0x1)); //hex grid
 			int i = Y * m_width + X;
 
-			//_ASSERT(n < K);
-
-			//kseedsl[n] = m_lvec[i];
-			//kseedsa[n] = m_avec[i];
-			//kseedsb[n] = m_bvec[i];
-			//kseedsx[n] = X;
-			//kseedsy[n] = Y;
-			kseedsl.push_back(m_lvec[i]);
-			kseedsa.push_back(m_avec[i]);
-			kseedsb.push_back(m_bvec[i]);
-			kseedsx.push_back(X);
-			kseedsy.push_back(Y);
-			n++;
+			kseedsl[n] = m_lvec[i];
+			kseedsa[n] = m_avec[i];
+			kseedsb[n] = m_bvec[i];
+			kseedsx[n] = X;
+			kseedsy[n] = Y;
 		}
-		r++;
 	}
 
 	if (perturbseeds)
@@ -451,11 +1407,163 @@ void SLIC::GetLABXYSeeds_ForGivenK(
 	}
 }
 
+//===========================================================================
+///	ReserveWorkspace
+///
+///	Make sure the image sized buffers (Lab planes, connectivity scratch)
+/// can hold a width x height image. They only ever grow, so once
+/// the largest frame has been seen, further calls do not touch the heap.
+//===========================================================================
+void SLIC::ReserveWorkspace(const int &width, const int &height)
+{
+	const size_t sz = (size_t)width * height;
+	if (sz > m_workspace_size)
+	{
+		delete[] m_lvec;
+		delete[] m_avec;
+		delete[] m_bvec;
+		m_lvec = new lab_t[sz];
+		m_avec = new lab_t[sz];
+		m_bvec = new lab_t[sz];
+		m_workspace_size = sz;
+	}
+	if (m_interleaved && sz > m_labxy_size)
+	{
+		if (m_labxy)
+			_mm_free(m_labxy);
+		m_labxy = (lab_pixel *)_mm_malloc(sz * sizeof(lab_pixel), 64);
+		m_labxy_size = sz;
+	}
+	if (m_nlabels.size() < sz)
+		m_nlabels.resize(sz);
+}
+
+//===========================================================================
+///	ReserveClusterSums
+///
+///	Grow the per thread cluster sums to hold at least count entries. The
+/// buffer is cache line aligned and is only freed by the destructor.
+//===========================================================================
+void SLIC::ReserveClusterSums(const size_t &count)
+{
+	if (count <= m_clustersums_size)
+		return;
+	if (m_clustersums)
+		_mm_free(m_clustersums);
+	m_clustersums = (cluster_sum *)_mm_malloc(count * sizeof(cluster_sum), 64);
+	m_clustersums_size = count;
+}
+
+//===========================================================================
+///	ReserveDistanceRows
+///
+///	Grow distlab and distvec to count entries each, one image row per
+/// thread. Both are only read back within the row that wrote them.
+//===========================================================================
+void SLIC::ReserveDistanceRows(const size_t &count)
+{
+	if (count <= m_distrows_size)
+		return;
+	delete[] m_distlab;
+	delete[] m_distvec;
+	m_distlab = new lab_t[count];
+	m_distvec = new lab_t[count];
+	m_distrows_size = count;
+}
+
+//===========================================================================
+///	PackLabPixels
+///
+///	Interleave the Lab planes into m_labxy. The planes stay the reference
+/// copy for seeding; only the assignment and the centroid sums read m_labxy.
+//===========================================================================
+void SLIC::PackLabPixels()
+{
+	const int sz = m_width * m_height;
+	lab_pixel *labxy = m_labxy;
+#if _OPENMP
+#pragma omp parallel for simd
+#endif
+	for (int i = 0; i < sz; i++)
+	{
+		labxy[i].l = m_lvec[i];
+		labxy[i].a = m_avec[i];
+		labxy[i].b = m_bvec[i];
+		labxy[i].pad = 0;
+	}
+	m_labxy_packed = true;
+}
+
+//===========================================================================
+///	BuildSeedBands
+///
+/// Bins the seeds into horizontal bands of bandheight rows, each cut into
+/// tiles of tilewidth columns (tilewidth >= width gives one tile per band).
+/// Tile t = band * tilesx + column lists, in ascending seed order, every
+/// seed whose [x - offset, x + offset) x [y - offset, y + offset) window
+/// overlaps it, as a CSR array: bandseeds[bandstart[t] .. bandstart[t + 1]).
+//===========================================================================
+void SLIC::BuildSeedBands(
+	const vector<double> &kseedsx,
+	const vector<double> &kseedsy,
+	const int &width,
+	const int &height,
+	const int &offset,
+	const int &bandheight,
+	const int &tilewidth,
+	vector<int> &bandstart,
+	vector<int> &bandseeds)
+{
+	const int numk = kseedsy.size();
+	const int numtiles = bandstart.size() - 1;
+	const int tilesx = (width + tilewidth - 1) / tilewidth;
+
+	std::fill(bandstart.begin(), bandstart.end(), 0);
+	for (int n = 0; n < numk; n++)
+	{
+		const int y1 = max(0, (int)(kseedsy[n] - offset));
+		const int y2 = min(height, (int)(kseedsy[n] + offset));
+		const int x1 = max(0, (int)(kseedsx[n] - offset));
+		const int x2 = min(width, (int)(kseedsx[n] + offset));
+		if (y1 >= y2 || x1 >= x2)
+			continue;
+		for (int b = y1 / bandheight; b <= (y2 - 1) / bandheight; b++)
+			for (int c = x1 / tilewidth; c <= (x2 - 1) / tilewidth; c++)
+				bandstart[b * tilesx + c + 1]++;
+	}
+	for (int t = 0; t < numtiles; t++)
+		bandstart[t + 1] += bandstart[t];
+
+	bandseeds.resize(bandstart[numtiles]);
+	vector<int> &cursor = m_bandcursor;
+	cursor.assign(bandstart.begin(), bandstart.end() - 1);
+	for (int n = 0; n < numk; n++)
+	{
+		const int y1 = max(0, (int)(kseedsy[n] - offset));
+		const int y2 = min(height, (int)(kseedsy[n] + offset));
+		const int x1 = max(0, (int)(kseedsx[n] - offset));
+		const int x2 = min(width, (int)(kseedsx[n] + offset));
+		if (y1 >= y2 || x1 >= x2)
+			continue;
+		for (int b = y1 / bandheight; b <= (y2 - 1) / bandheight; b++)
+			for (int c = x1 / tilewidth; c <= (x2 - 1) / tilewidth; c++)
+				bandseeds[cursor[b * tilesx + c]++] = n;
+	}
+}
+
 //===========================================================================
 ///	PerformSuperpixelSegmentation_VariableSandM
 ///
 ///	Magic SLIC - no parameters
 ///
+/// Runs NUMITR iterations, or fewer when a convergence threshold is set and
+/// the residual error E drops below it (see SetConvergence).
+///
+/// dirtytiles, when not NULL, restricts the assignment to those tiles of the
+/// tiled schedule, and active to the seeds that get moved; the other seeds
+/// and the labels outside the tiles stay as they are. This is the
+/// incremental pass of PerformSLICO_Incremental.
+///
 ///	Performs k mean segmentation. It is fast because it looks locally, not
 /// over the entire image.
 /// This function picks the maximum value of color distance as compact factor
@@ -477,9 +1585,11 @@ void SLIC::PerformSuperpixelSegmentation_VariableSandM(
 	vector<double> &kseedsy,
 	int *klabels,
 	const int &STEP,
-	const int &NUMITR)
+	const int &NUMITR,
+	const bool &warm,
+	const vector<int> *dirtytiles,
+	const vector<char> *active)
 {
-	int sz = m_width * m_height;
 	const int numk = kseedsl.size();
 	//double cumerr(99999.9);
 	// int numitr(0);
@@ -490,134 +1600,204 @@ void SLIC::PerformSuperpixelSegmentation_VariableSandM(
 		offset = STEP * 1.5;
 	//----------------
 
-	vector<double> sigmal(numk, 0);
-	vector<double> sigmaa(numk, 0);
-	vector<double> sigmab(numk, 0);
-	vector<double> sigmax(numk, 0);
-	vector<double> sigmay(numk, 0);
-	vector<int> clustersize(numk, 0);
-	vector<double> inv(numk, 0);   //to store 1/clustersize[k] values
-	auto distlab = new double[sz]; // Do not init, and do not use vector
-	// vector<double> distvec(sz, DBL_MAX);
-	auto distvec = new double[sz];		  // Do not init, and do not use vector
-	vector<double> maxlab(numk, 10 * 10); //THIS IS THE VARIABLE VALUE OF M, just start with 10
-
-	double invxywt = 1.0 / (STEP * STEP); //NOTE: this is different from how usual SLIC/LKM works
+	vector<double> &maxlab = m_maxlab;
+	if (!warm)
+		maxlab.assign(numk, 10 * 10); //THIS IS THE VARIABLE VALUE OF M, just start with 10
+	const double threshold = dirtytiles ? m_incremental_threshold : warm ? m_warm_threshold : m_threshold;
+
+	const lab_t invxywt = 1.0 / (STEP * STEP); //NOTE: this is different from how usual SLIC/LKM works
 	const int width = m_width;			  // Allow compiler to vectorize code
 
+	// Seeds binned into horizontal bands of bandheight rows, so a row only
+	// visits the seeds whose window can reach it. The tiled schedule also cuts
+	// the bands into bandheight wide tiles and hands whole tiles to threads:
+	// the six per pixel planes of a tile then stay in L2 while its few seeds
+	// sweep over it, so an iteration reads the image about once. Pixels see
+	// the same seeds in the same order either way, so the labels match.
+	const bool tiled = m_tiled || dirtytiles;
+	const int bandheight = max(1, offset);
+	const int numbands = (m_height + bandheight - 1) / bandheight;
+	const int tilewidth = tiled ? bandheight : m_width;
+	const int tilesx = (m_width + tilewidth - 1) / tilewidth;
+	const int tileheight = tiled ? bandheight : 1;
+	const int numtasks = dirtytiles ? dirtytiles->size() : tiled ? numbands * tilesx : m_height;
+	int numactive = numk;
+	if (active)
+		numactive = std::count(active->begin(), active->end(), 1);
+	vector<int> &bandstart = m_bandstart;
+	vector<int> &bandseeds = m_bandseeds;
+	bandstart.resize(numbands * tilesx + 1);
+
+	const assign_row_fn AssignRow = Kernels().assign_row;
+	const assign_packed_fn AssignPacked = Kernels().assign_packed;
+	const lab_pixel *labxy = m_interleaved ? m_labxy : NULL;
+	vector<lab_seed> &seeds = m_seeds;
+	seeds.resize(numk);
+
+	// One row of numk cluster sums per thread, kept across iterations
+	const int maxthreads = omp_get_max_threads();
+	ReserveClusterSums((size_t)maxthreads * numk);
+
+	// distvec and distlab are only needed until the row they belong to has
+	// been accumulated, so each thread keeps a single image row of each. The
+	// distlab maxlab picks up is the last seed's to visit the pixel, not the
+	// winner's, as it has always been; a row buffer keeps that while the
+	// stores stay in L1 instead of streaming two image sized buffers.
+	ReserveDistanceRows((size_t)maxthreads * width);
+
+	m_stats.assign_ms.clear();
+	m_stats.update_ms.clear();
+	m_stats.assign_ms.reserve(NUMITR);
+	m_stats.update_ms.reserve(NUMITR);
+	m_stats.distances = 0;
+	long long distances = 0;
+
 	for (int numitr = 0; numitr < NUMITR; numitr++)
 	{
-
-		vector<double> maxlab_old(maxlab);
+		Clock::time_point assignStart = Clock::now();
+		Clock::time_point updateStart;
+		BuildSeedBands(kseedsx, kseedsy, m_width, m_height, offset, bandheight, tilewidth, bandstart, bandseeds);
+		double residual = 0;
+		for (int n = 0; n < numk; n++)
+		{
+			seeds[n].l = kseedsl[n];
+			seeds[n].a = kseedsa[n];
+			seeds[n].b = kseedsb[n];
+			seeds[n].x = kseedsx[n];
+			seeds[n].y = kseedsy[n];
+			seeds[n].maxlab = maxlab[n];
+		}
 
 #if _OPENMP
-#pragma omp parallel for schedule(guided) reduction(vec_double_sum                                                                              \
-													: sigmal, sigmaa, sigmab, sigmax, sigmay) reduction(vec_int_sum                             \
-																										: clustersize) reduction(vec_double_max \
-																																 : maxlab)
+#pragma omp parallel reduction(+ \
+							   : distances)
 #endif
-		for (int y = 0; y < m_height; y++)
 		{
-			int cnt = 0;
-			cnt++;
-
-			for (int x = 0; x < m_width; x++)
+			const int thread_id = omp_get_thread_num();
+			const int thread_num = omp_get_num_threads();
+			cluster_sum *sums = m_clustersums + (size_t)thread_id * numk;
+			lab_t *distlab = m_distlab + (size_t)thread_id * width;
+			lab_t *distvec = m_distvec + (size_t)thread_id * width;
+			for (int k = 0; k < numk; k++)
 			{
-				int i = y * m_width + x;
-				distvec[i] = DBL_MAX;
+				sums[k].l = sums[k].a = sums[k].b = 0;
+				sums[k].x = sums[k].y = 0;
+				sums[k].maxlab = 0;
+				sums[k].count = 0;
 			}
-			for (int n = 0; n < numk; n++)
-			{
-				// Abort if out of range
-				if (!((int)(kseedsy[n] - offset) <= y && y < (int)(kseedsy[n] + offset)))
-				{
-					continue;
-				}
 
-				const int x1 = max(0, (int)(kseedsx[n] - offset));
-				const int x2 = min(m_width, (int)(kseedsx[n] + offset));
-				const double inv_maxlab = 1 / maxlab_old[n];
-				const double cons_kseedsl = kseedsl[n];
-				const double cons_kseedsa = kseedsa[n];
-				const double cons_kseedsb = kseedsb[n];
-				const double cons_kseedsx = kseedsx[n];
-				const double cons_y = (y - kseedsy[n]) * (y - kseedsy[n]);
-				for (int x = x1; x < x2; x++)
+#pragma omp for schedule(guided)
+			for (int task = 0; task < numtasks; task++)
+			{
+				// A row across the image, or one tile
+				const int tile = dirtytiles ? (*dirtytiles)[task] : tiled ? task : task / bandheight;
+				const int ty1 = tiled ? (tile / tilesx) * bandheight : task;
+				const int ty2 = min(m_height, ty1 + tileheight);
+				const int tx1 = (tile % tilesx) * tilewidth;
+				const int tx2 = min(m_width, tx1 + tilewidth);
+
+				for (int y = ty1; y < ty2; y++)
 				{
-					int i = y * width + x;
-					// _ASSERT(y < m_height && x < m_width && y >= 0 && x >= 0);
-
-					double l = m_lvec[i];
-					double a = m_avec[i];
-					double b = m_bvec[i];
-
-					distlab[i] = (l - cons_kseedsl) * (l - cons_kseedsl) +
-								 (a - cons_kseedsa) * (a - cons_kseedsa) +
-								 (b - cons_kseedsb) * (b - cons_kseedsb);
-					double distxy = (x - cons_kseedsx) * (x - cons_kseedsx) + cons_y;
+					const size_t row = (size_t)y * width;
+					for (int x = tx1; x < tx2; x++)
+						distvec[x] = LAB_MAX;
 
-					//------------------------------------------------------------------------
-					double dist = distlab[i] * inv_maxlab + distxy * invxywt; //only varying m, prettier superpixels
-																			  //------------------------------------------------------------------------
-
-					if (dist < distvec[i])
+					const planar_row planes = {m_lvec + row, m_avec + row, m_bvec + row};
+					const packed_row packed = {labxy + row};
+					for (int s = bandstart[tile]; s < bandstart[tile + 1]; s++)
 					{
-						klabels[i] = n;
-						distvec[i] = dist;
+						const int n = bandseeds[s];
+						const lab_seed &sd = seeds[n];
+						// Abort if out of range
+						if (!((int)(sd.y - offset) <= y && y < (int)(sd.y + offset)))
+						{
+							continue;
+						}
+
+						const int x1 = max(tx1, (int)(sd.x - offset));
+						const int x2 = min(tx2, (int)(sd.x + offset));
+						distances += max(0, x2 - x1);
+
+						assign_seed seed;
+						seed.l = sd.l;
+						seed.a = sd.a;
+						seed.b = sd.b;
+						seed.x = sd.x;
+						seed.cons_y = (y - sd.y) * (y - sd.y);
+						seed.inv_maxlab = 1 / sd.maxlab;
+						seed.invxywt = invxywt;
+						seed.n = n;
+
+						if (labxy)
+							AssignPacked(packed, distlab, distvec, klabels + row, x1, x2, seed);
+						else
+							AssignRow(planes, distlab, distvec, klabels + row, x1, x2, seed);
 					}
+
+					if (labxy)
+						AccumulateRow(packed, distlab, klabels + row, tx1, tx2, y, sums);
+					else
+						AccumulateRow(planes, distlab, klabels + row, tx1, tx2, y, sums);
 				}
 			}
 
-			for (int x = 0; x < m_width; x++)
+			#pragma omp master
+			updateStart = Clock::now();
+
+			//-----------------------------------------------------------------
+			// Combine the per thread sums, each thread owning a range of
+			// clusters, and move the seeds to the new centroids.
+			//-----------------------------------------------------------------
+#pragma omp for reduction(+ \
+						  : residual)
+			for (int k = 0; k < numk; k++)
 			{
-				//-----------------------------------------------------------------
-				// Assign the max color distance for a cluster
-				//-----------------------------------------------------------------
-				int i = y * width + x;
-				int idx = klabels[i];
-				if (numitr == 0 && cnt == 1)
+				if (active && !(*active)[k])
+					continue;
+				cluster_sum total = m_clustersums[k];
+				for (int t = 1; t < thread_num; t++)
 				{
-					maxlab[idx] = 1;
+					const cluster_sum &sum = m_clustersums[(size_t)t * numk + k];
+					total.l += sum.l;
+					total.a += sum.a;
+					total.b += sum.b;
+					total.x += sum.x;
+					total.y += sum.y;
+					total.maxlab = max(total.maxlab, sum.maxlab);
+					total.count += sum.count;
 				}
-				if (maxlab[idx] < distlab[i])
-					maxlab[idx] = distlab[i];
-				// distvec[i] = DBL_MAX;
-				//-----------------------------------------------------------------
-				// Recalculate the centroid and store in the seed values
-				//-----------------------------------------------------------------
-
-				//_ASSERT(klabels[j] >= 0);
-				sigmal[idx] += m_lvec[i];
-				sigmaa[idx] += m_avec[i];
-				sigmab[idx] += m_bvec[i];
-				sigmax[idx] += x;
-				sigmay[idx] += y;
-
-				clustersize[idx]++;
+				maxlab[k] = max(maxlab[k], total.maxlab);
+				if (total.count == 0 && (m_warm || dirtytiles))
+					continue; // keep an emptied cluster in place, later frames may refill it
+
+				//_ASSERT(total.count > 0);
+				const double inv = 1.0 / double(total.count); //computing inverse now to multiply, than divide later
+
+				const double newx = total.x * inv;
+				const double newy = total.y * inv;
+				if (total.count > 0)
+					residual += sqrt((newx - kseedsx[k]) * (newx - kseedsx[k]) + (newy - kseedsy[k]) * (newy - kseedsy[k]));
+
+				kseedsl[k] = total.l * inv;
+				kseedsa[k] = total.a * inv;
+				kseedsb[k] = total.b * inv;
+				kseedsx[k] = newx;
+				kseedsy[k] = newy;
 			}
 		}
-		for (int k = 0; k < numk; k++)
-		{
-			//_ASSERT(clustersize[k] > 0);
-			// if (clustersize[k] <= 0)
-			// 	clustersize[k] = 1;
-			inv[k] = 1.0 / double(clustersize[k]); //computing inverse now to multiply, than divide later
 
-			kseedsl[k] = sigmal[k] * inv[k];
-			kseedsa[k] = sigmaa[k] * inv[k];
-			kseedsb[k] = sigmab[k] * inv[k];
-			kseedsx[k] = sigmax[k] * inv[k];
-			kseedsy[k] = sigmay[k] * inv[k];
-
-			// Reset
-			sigmal[k] = 0;
-			sigmaa[k] = 0;
-			sigmab[k] = 0;
-			sigmax[k] = 0;
-			sigmay[k] = 0;
-			clustersize[k] = 0;
-		}
+		//-----------------------------------------------------------------
+		// Residual error E: mean centroid displacement, in units of STEP
+		//-----------------------------------------------------------------
+		Clock::time_point updateEnd = Clock::now();
+		m_stats.assign_ms.push_back(ElapsedMs(assignStart, updateStart));
+		m_stats.update_ms.push_back(ElapsedMs(updateStart, updateEnd));
+		m_stats.residual = numactive > 0 ? residual / numactive / STEP : 0;
+		m_stats.iterations = numitr + 1;
+		if (threshold > 0 && m_stats.residual < threshold)
+			break;
 	}
+	m_stats.distances = distances;
 }
 
 //===========================================================================
@@ -663,294 +1843,1984 @@ void SLIC::SaveSuperpixelLabels2PPM(
 	std::fclose(fp);
 }
 
+//===========================================================================
+///	FindRoot / UnionRoots
+///
+///	Union-find over pixel indices for EnforceLabelConnectivity. A tree is
+/// always linked under its smallest index, so the root of a component is
+/// its first pixel in raster order. UnionRoots is lock-free and may run
+/// concurrently on the same trees.
+//===========================================================================
+static inline int FindRoot(const int *parent, int i)
+{
+	while (parent[i] != i)
+		i = parent[i];
+	return i;
+}
+
+static inline void UnionRoots(int *parent, int a, int b)
+{
+	for (;;)
+	{
+		a = FindRoot(parent, a);
+		b = FindRoot(parent, b);
+		if (a == b)
+			return;
+		if (a < b)
+			std::swap(a, b);
+		if (__sync_bool_compare_and_swap(&parent[a], a, b))
+			return;
+	}
+}
+
 //===========================================================================
 ///	EnforceLabelConnectivity
 ///
 ///		1. finding an adjacent label for each new component at the start
 ///		2. if a certain component is too small, assigning the previously found
 ///		    adjacent label to this component, and not incrementing the label.
+///
+///	Components are found by a two pass union-find over row strips, one per
+///	thread, whose seams are then merged in parallel. Components are numbered
+///	in raster order of their first pixel and small ones take the label of
+///	the last already numbered 4-neighbour of that pixel, as the sequential
+///	BFS version did.
 //===========================================================================
 void SLIC::EnforceLabelConnectivity(
 	int *labels, //input labels that need to be corrected to remove stray labels
 	const int &width,
 	const int &height,
-	int *nlabels,	//new labels
+	int *nlabels,	//scratch, holds the union-find forest, then component numbers
 	int &numlabels, //the number of labels changes in the end if segments are removed
 	const int &K)	//the number of superpixels desired by the user
 {
-	//	const int dx8[8] = {-1, -1,  0,  1, 1, 1, 0, -1};
-	//	const int dy8[8] = { 0, -1, -1, -1, 0, 1, 1,  1};
-
 	const int dx4[4] = {-1, 0, 1, 0};
 	const int dy4[4] = {0, -1, 0, 1};
 
 	const int sz = width * height;
 	const int SUPSZ = sz / K;
-//nlabels.resize(sz, -1);
-#pragma omp parallel for simd //schedule(static, 2048)
-	for (int i = 0; i < sz; i++)
-		nlabels[i] = -1;
-	// int oindex(0);
-	// int adjlabel(0); //adjacent label
-
-	vector<area_info> seg_info;
 
-	// BFS to tag new label, and gather info for mapping
-	vector<omp_lock_t> lock_vec(numlabels);
-	for (size_t i = 0; i < numlabels; i++)
-	{
-		omp_init_lock(&lock_vec[i]);
-	}
+	// Scratch kept across calls; only the union-find forest in nlabels is
+	// image sized, the rest grows with the number of components.
+	vector<area_info> &seg_info = m_seginfo;
+	vector<int> &strip_roots = m_striproots;
+	vector<int> &new_label = m_newlabel;
+	const remap_labels_fn remap_labels = Kernels().remap_labels;
 
-	int local_label = 0;
-	int label = 0;
-	unordered_map<int, area_info *> seg_label_map;
-	deque<pair<int, area_info *>> shrinked_area;
 #if _OPENMP
-#pragma omp parallel private(local_label)
+#pragma omp parallel
 #endif
 	{
-		int *xvec = new int[sz];
-		int *yvec = new int[sz];
 		const int thread_id = omp_get_thread_num();
 		const int thread_num = omp_get_num_threads();
-#if _OPENMP
-#pragma omp for private(local_label)
-#endif
-		for (int j = 0; j < height; j++)
+		const int y1 = (long long)height * thread_id / thread_num;
+		const int y2 = (long long)height * (thread_id + 1) / thread_num;
+
+#pragma omp single
+		strip_roots.assign(thread_num + 1, 0);
+
+		//--------------------------------------------------
+		// Pass 1: label the strip, links stay inside it
+		//--------------------------------------------------
+		for (int y = y1; y < y2; y++)
 		{
-			for (int k = 0; k < width; k++)
+			for (int x = 0; x < width; x++)
 			{
-				int seg_label = local_label * thread_num + thread_id;
-
-				int oindex = j * width + k;
-				if (nlabels[oindex] >= 0)
+				const int i = y * width + x;
+				nlabels[i] = i;
+				if (x > 0 && labels[i - 1] == labels[i])
+					nlabels[i] = FindRoot(nlabels, i - 1);
+				if (y > y1 && labels[i - width] == labels[i])
 				{
-					continue;
-				}
-				omp_set_lock(&lock_vec[labels[oindex]]);
-				if (nlabels[oindex] >= 0)
-				{
-					omp_unset_lock(&lock_vec[labels[oindex]]);
-					continue;
+					int a = FindRoot(nlabels, i);
+					int b = FindRoot(nlabels, i - width);
+					if (a != b)
+						nlabels[max(a, b)] = min(a, b);
 				}
+			}
+		}
+#pragma omp barrier
 
-				area_info info;
-				info.index = oindex;
-				info.x = k;
-				info.y = j;
-				info.seg_label = seg_label;
-				info.new_label = 0;
+		//--------------------------------------------------
+		// Merge the seam above each strip
+		//--------------------------------------------------
+		if (y1 > 0 && y1 < y2)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const int i = y1 * width + x;
+				if (labels[i - width] == labels[i])
+					UnionRoots(nlabels, i, i - width);
+			}
+		}
+#pragma omp barrier
 
-				nlabels[oindex] = seg_label;
-				//--------------------
-				// Start a new segment
-				//--------------------
-				xvec[0] = k;
-				yvec[0] = j;
+		//--------------------------------------------------
+		// Pass 2: point every pixel at its root, count roots
+		//--------------------------------------------------
+		int roots = 0;
+		for (int i = y1 * width; i < y2 * width; i++)
+		{
+			const int r = FindRoot(nlabels, i);
+			nlabels[i] = r;
+			roots += (r == i);
+		}
+		strip_roots[thread_id + 1] = roots;
+#pragma omp barrier
+#pragma omp single
+		{
+			for (int t = 0; t < thread_num; t++)
+				strip_roots[t + 1] += strip_roots[t];
+			seg_info.resize(strip_roots[thread_num]);
+		}
 
-				// BFS
-				int count(1);
-				for (int c = 0; c < count; c++)
-				{
-					for (int n = 0; n < 4; n++)
-					{
-						int x = xvec[c] + dx4[n];
-						int y = yvec[c] + dy4[n];
+		// Number the components in raster order of their first pixel. The
+		// input labels are no longer needed, so a root keeps its component
+		// number in labels[root].
+		int c = strip_roots[thread_id];
+		for (int i = y1 * width; i < y2 * width; i++)
+		{
+			if (nlabels[i] != i)
+				continue;
+			area_info &info = seg_info[c];
+			info.index = i;
+			info.x = i % width;
+			info.y = i / width;
+			info.count = 0;
+			info.seg_label = i;
+			info.new_label = 0;
+			labels[i] = c++;
+		}
+#pragma omp barrier
 
-						if ((x >= 0 && x < width) && (y >= 0 && y < height))
-						{
-							int nindex = y * width + x;
+		// Component sizes, one atomic add per run of equal roots. The run is
+		// rewritten with its component number, so from here on nlabels holds
+		// dense component numbers instead of root pixel indices.
+		for (int y = y1; y < y2; y++)
+		{
+			int *row = nlabels + y * width;
+			int x = 0;
+			while (x < width)
+			{
+				const int r = row[x];
+				const int c = labels[r];
+				int run = 1;
+				while (x + run < width && row[x + run] == r)
+					run++;
+				for (int k = x; k < x + run; k++)
+					row[k] = c;
+#pragma omp atomic
+				seg_info[c].count += run;
+				x += run;
+			}
+		}
+#pragma omp barrier
 
-							if (nlabels[nindex] < 0 && labels[oindex] == labels[nindex])
-							{
-								xvec[count] = x;
-								yvec[count] = y;
-								if (info.index > nindex)
-								{
-									info.index = nindex;
-									info.x = x;
-									info.y = y;
-								}
-
-								nlabels[nindex] = seg_label;
-								count++;
-							}
-						}
-					}
-				}
-				info.count = count;
-#pragma omp critical
+		//--------------------------------------------------
+		// Small components: find the adjacent component
+		//--------------------------------------------------
+		const int numseg = seg_info.size();
+#pragma omp for
+		for (int s = 0; s < numseg; s++)
+		{
+			area_info &info = seg_info[s];
+			info.adjacent_index = -1;
+			if (info.count > SUPSZ >> 2)
+				continue;
+			// The last 4-neighbour of the first pixel that belongs to an
+			// earlier component, i.e. one the BFS would already have labelled.
+			for (int n = 0; n < 4; n++)
+			{
+				int x = info.x + dx4[n];
+				int y = info.y + dy4[n];
+				if ((x >= 0 && x < width) && (y >= 0 && y < height))
 				{
-					seg_info.push_back(info);
+					int c = nlabels[y * width + x];
+					if (c < s)
+						info.adjacent_index = c;
 				}
-				omp_unset_lock(&lock_vec[labels[oindex]]);
-				local_label++;
 			}
 		}
 
-#pragma omp master
+#pragma omp single
+		{
+			int label = 0;
+			for (int s = 0; s < numseg; s++)
+			{
+				if (seg_info[s].count > SUPSZ >> 2)
+					seg_info[s].new_label = label++;
+			}
+			numlabels = label;
+			new_label.resize(numseg);
+		}
+
+		// Follow the chain of absorptions down to a kept component. Chains
+		// only go to earlier components, so they always terminate.
+#pragma omp for
+		for (int s = 0; s < numseg; s++)
+		{
+			if (seg_info[s].count > SUPSZ >> 2)
+				continue;
+			int a = seg_info[s].adjacent_index;
+			while (a >= 0 && seg_info[a].count <= SUPSZ >> 2)
+				a = seg_info[a].adjacent_index;
+			seg_info[s].new_label = a >= 0 ? seg_info[a].new_label : 0;
+		}
+#pragma omp for
+		for (int s = 0; s < numseg; s++)
+			new_label[s] = seg_info[s].new_label;
+
+		//--------------------------------------------------
+		// Map old label to new label
+		//--------------------------------------------------
+		// Each thread gathers its own strip; the loop above ends in a barrier.
+		const size_t first = (size_t)y1 * width;
+		remap_labels(new_label.data(), nlabels + first, labels + first, (y2 - y1) * width);
+	}
+}
+
+//===========================================================================
+///	InitRGBtoLABLUT
+///
+///	Fill the gamma lookup tables used by DoRGBtoLABConversion.
+//===========================================================================
+void SLIC::InitRGBtoLABLUT()
+{
+	for (size_t i = 0; i < 256; i++)
+	{
+		double tmp = i / 255.0;
+		rgb_lut[i] = tmp / 12.92;
+		rgb_pow_lut[i] = pow((tmp + 0.055) / 1.055, 2.4);
+	}
+}
+
+//===========================================================================
+///	PerformSLICO_ForGivenK
+///
+/// Zero parameter SLIC algorithm for a given number K of superpixels.
+//===========================================================================
+void SLIC::PerformSLICO_ForGivenK(
+	const unsigned int *ubuff,
+	const int width,
+	const int height,
+	int *klabels,
+	int &numlabels,
+	const int &K,	 //required number of superpixels
+	const double &m) //weight given to spatial distance
+{
+	auto totalStart = Clock::now();
+	//--------------------------------------------------
+	m_width = width;
+	m_height = height;
+	//--------------------------------------------------
+
+	//--------------------------------------------------
+	// RGB2LAB
+	InitRGBtoLABLUT();
+	ReserveWorkspace(width, height);
+
+	// Convert
+	auto startTime = Clock::now();
+	DoRGBtoLABConversion(ubuff, m_lvec, m_avec, m_bvec);
+	m_stats.rgb2lab_ms = ElapsedMs(startTime, Clock::now());
+
+	PerformSLICO_OnLAB(klabels, numlabels, K, m);
+
+	m_stats.total_ms = ElapsedMs(totalStart, Clock::now());
+	if (m_verbose)
+		PrintStats(std::cout);
+}
+
+//===========================================================================
+///	PerformSLICO_ForGivenK
+///
+/// Same as above, for a packed 24 bit image read in place, e.g. a memory
+/// mapped P6 payload. stride is the distance in bytes between rows.
+//===========================================================================
+void SLIC::PerformSLICO_ForGivenK(
+	const unsigned char *rgb,
+	const size_t stride,
+	const int width,
+	const int height,
+	int *klabels,
+	int &numlabels,
+	const int &K,
+	const double &m)
+{
+	auto totalStart = Clock::now();
+	m_width = width;
+	m_height = height;
+
+	InitRGBtoLABLUT();
+	ReserveWorkspace(width, height);
+	auto startTime = Clock::now();
+	DoRGBtoLABConversion(rgb, stride, m_lvec, m_avec, m_bvec);
+	m_stats.rgb2lab_ms = ElapsedMs(startTime, Clock::now());
+
+	PerformSLICO_OnLAB(klabels, numlabels, K, m);
+
+	m_stats.total_ms = ElapsedMs(totalStart, Clock::now());
+	if (m_verbose)
+		PrintStats(std::cout);
+}
+
+//===========================================================================
+///	SetBatchThreshold
+///
+///	Images of at least this many pixels are segmented with all threads,
+/// smaller ones one per thread. Default 1M pixels, below which the serial
+/// parts of a run leave most of the threads idle.
+//===========================================================================
+void SLIC::SetBatchThreshold(const int &pixels)
+{
+	m_batch_threshold = pixels;
+}
+
+//===========================================================================
+///	PerformSLICO_Batch
+///
+/// Large images first, in turn, on this instance. The small ones are then
+/// handed out largest first with a dynamic schedule, so a thread that
+/// finishes early takes the next image; each thread runs its images on its
+/// own worker instance with nested regions limited to one thread.
+//===========================================================================
+void SLIC::PerformSLICO_Batch(vector<BatchImage> &images)
+{
+	// Small images as (-pixels, index), so sorting puts the largest first
+	vector<int> large;
+	vector<pair<long long, int> > small;
+	for (int i = 0; i < (int)images.size(); i++)
+	{
+		const long long pixels = (long long)images[i].width * images[i].height;
+		if (pixels >= m_batch_threshold)
+			large.push_back(i);
+		else
+			small.push_back(make_pair(-pixels, i));
+	}
+	std::sort(small.begin(), small.end());
+
+	for (size_t j = 0; j < large.size(); j++)
+	{
+		BatchImage &img = images[large[j]];
+		if (img.ubuff)
+			PerformSLICO_ForGivenK(img.ubuff, img.width, img.height, img.klabels, img.numlabels, img.K, img.m);
+		else
+			PerformSLICO_ForGivenK(img.rgb, img.stride, img.width, img.height, img.klabels, img.numlabels, img.K, img.m);
+		img.stats = m_stats;
+	}
+	if (small.empty())
+		return;
+
+	const int maxthreads = omp_get_max_threads();
+	while ((int)m_workers.size() < maxthreads)
+		m_workers.push_back(new SLIC());
+	for (int w = 0; w < maxthreads; w++)
+	{
+		SLIC &worker = *m_workers[w];
+		worker.m_use_lab_table = m_use_lab_table;
+		worker.m_threshold = m_threshold;
+		worker.m_maxitr = m_maxitr;
+		worker.m_tiled = m_tiled;
+		worker.m_interleaved = m_interleaved;
+	}
+
+	const int numsmall = small.size();
+#if _OPENMP
+#pragma omp parallel
+#endif
+	{
+		// Parallel regions inside this thread's runs get a team of one
+		omp_set_num_threads(1);
+		SLIC &worker = *m_workers[omp_get_thread_num()];
+#pragma omp for schedule(dynamic, 1)
+		for (int j = 0; j < numsmall; j++)
 		{
-			std::sort(seg_info.begin(), seg_info.end());
+			BatchImage &img = images[small[j].second];
+			if (img.ubuff)
+				worker.PerformSLICO_ForGivenK(img.ubuff, img.width, img.height, img.klabels, img.numlabels, img.K, img.m);
+			else
+				worker.PerformSLICO_ForGivenK(img.rgb, img.stride, img.width, img.height, img.klabels, img.numlabels, img.K, img.m);
+			img.stats = worker.m_stats;
+		}
+	}
+}
+
+//===========================================================================
+///	ChannelDelta
+///
+///	Largest difference between the R, G and B of two ARGB pixels.
+//===========================================================================
+static inline int ChannelDelta(const unsigned int &p, const unsigned int &q)
+{
+	const int dr = abs((int)(p >> 16 & 0xFF) - (int)(q >> 16 & 0xFF));
+	const int dg = abs((int)(p >> 8 & 0xFF) - (int)(q >> 8 & 0xFF));
+	const int db = abs((int)(p & 0xFF) - (int)(q & 0xFF));
+	return max(dr, max(dg, db));
+}
+
+//===========================================================================
+///	InitIncrementalState
+///
+///	After a full run: keep the frame, count the pixels of each label and give
+/// each seed the final label of the pixel under its centroid, or of its first
+/// pixel when the centroid pixel went to another seed.
+//===========================================================================
+void SLIC::InitIncrementalState(const unsigned int *ubuff, const int *klabels, const int &numlabels)
+{
+	const int sz = m_width * m_height;
+	const int numk = m_kseedsl.size();
+	const int *raw = m_rawlabels.data();
+	m_prevframe.assign(ubuff, ubuff + sz);
+	m_labelcount.assign(numlabels, 0);
+	m_seedlabel.assign(numk, -1);
+	if (m_dirtyqueue.size() < (size_t)sz)
+		m_dirtyqueue.resize(sz);
+
+	for (int n = 0; n < numk; n++)
+	{
+		const int x = m_kseedsx[n] + 0.5;
+		const int y = m_kseedsy[n] + 0.5;
+		if (x >= 0 && x < m_width && y >= 0 && y < m_height && raw[y * m_width + x] == n)
+			m_seedlabel[n] = klabels[y * m_width + x];
+	}
+	for (int i = 0; i < sz; i++)
+	{
+		m_labelcount[klabels[i]]++;
+		if (m_seedlabel[raw[i]] < 0)
+			m_seedlabel[raw[i]] = klabels[i];
+	}
+}
+
+//===========================================================================
+///	EnforceDirtyTileConnectivity
+///
+///	EnforceLabelConnectivity restricted to the tiles flagged 2 in
+/// m_tileflags, whose m_rawlabels were just reassigned. Each pixel starts
+/// from its seed's label; the 4-connected components of those are then
+/// checked against the final labels around them. A component touching its
+/// own label keeps it, and so does the first one of a label found nowhere
+/// else. Other components of at most a quarter of the superpixel size take
+/// an adjacent label; larger ones get a new label.
+/// A label that lost pixels in the dirty tiles may be left in pieces outside
+/// them, so those labels are then split into components over the whole
+/// frame: the largest keeps the label, and the others are handled as above,
+/// a small one taking the label of a neighbour that is known to be connected.
+//===========================================================================
+void SLIC::EnforceDirtyTileConnectivity(
+	int *klabels,
+	const int &tilesize,
+	int &numlabels,
+	const int &K)
+{
+	const int dx4[4] = {-1, 0, 1, 0};
+	const int dy4[4] = {0, -1, 0, 1};
 
-			for (auto &info : seg_info)
+	const int width = m_width;
+	const int height = m_height;
+	const int tilesx = (width + tilesize - 1) / tilesize;
+	const int SUPSZ = width * height / K;
+	const char *flags = m_tileflags.data();
+	const int *raw = m_rawlabels.data();
+	int *nlabels = m_nlabels.data(); //-1 to visit, -2 queued, else the final label
+	int *queue = m_dirtyqueue.data();
+	const int numtiles = m_dirtytiles.size();
+	const int numold = numlabels;
+	vector<int> &largest = m_newlabel; //-2: kept all its pixels, else its largest component
+	largest.assign(numold, -2);
+
+	// The old labels leave the counts, the seeds' labels come in
+	for (int t = 0; t < numtiles; t++)
+	{
+		const int tile = m_dirtytiles[t];
+		const int ty1 = (tile / tilesx) * tilesize, ty2 = min(height, ty1 + tilesize);
+		const int tx1 = (tile % tilesx) * tilesize, tx2 = min(width, tx1 + tilesize);
+		for (int y = ty1; y < ty2; y++)
+		{
+			for (int x = tx1; x < tx2; x++)
 			{
-				if (info.count <= SUPSZ >> 2)
+				const int i = y * width + x;
+				m_labelcount[klabels[i]]--;
+				largest[klabels[i]] = -1;
+				int &seedlabel = m_seedlabel[raw[i]];
+				if (seedlabel < 0)
 				{
-					// info.new_label = info.adjacent_index;
-					shrinked_area.push_back(make_pair(info.seg_label, &info));
-					continue;
+					seedlabel = numlabels++;
+					m_labelcount.push_back(0);
 				}
-				info.new_label = label;
-				seg_label_map[info.seg_label] = &info;
-				label++;
+				klabels[i] = seedlabel;
+				nlabels[i] = -1;
 			}
+		}
+	}
 
-			while (!shrinked_area.empty())
+	for (int t = 0; t < numtiles; t++)
+	{
+		const int tile = m_dirtytiles[t];
+		const int ty1 = (tile / tilesx) * tilesize, ty2 = min(height, ty1 + tilesize);
+		const int tx1 = (tile % tilesx) * tilesize, tx2 = min(width, tx1 + tilesize);
+		for (int y = ty1; y < ty2; y++)
+		{
+			for (int x = tx1; x < tx2; x++)
 			{
-
-				auto pair = shrinked_area.front();
-				if (pair.second->index == 0)
-				{
-					seg_label_map[pair.first] = pair.second;
-					pair.second->new_label = 0;
-					shrinked_area.pop_front();
+				const int i = y * width + x;
+				if (nlabels[i] != -1)
 					continue;
-				}
 
-				//-------------------------------------------------------
-				// Quickly find an adjacent label for use later if needed
-				//-------------------------------------------------------
-				int adjacent_label = -1;
-				for (int n = 0; n < 4; n++)
+				const int label = klabels[i];
+				bool anchored = false;
+				int adjlabel = -1;
+				int count = 1;
+				queue[0] = i;
+				nlabels[i] = -2;
+				for (int c = 0; c < count; c++)
 				{
-					int x = pair.second->x + dx4[n];
-					int y = pair.second->y + dy4[n];
-					if ((x >= 0 && x < width) && (y >= 0 && y < height))
+					const int cx = queue[c] % width;
+					const int cy = queue[c] / width;
+					for (int n = 0; n < 4; n++)
 					{
-						int nindex = y * width + x;
-						if (nlabels[nindex] == pair.first)
-						{
+						const int xx = cx + dx4[n];
+						const int yy = cy + dy4[n];
+						if (xx < 0 || xx >= width || yy < 0 || yy >= height)
 							continue;
+						const int ni = yy * width + xx;
+						if (!(flags[(yy / tilesize) * tilesx + xx / tilesize] & 2))
+						{
+							// Outside the dirty tiles, a final label
+							if (klabels[ni] == label)
+								anchored = true;
+							else
+								adjlabel = klabels[ni];
 						}
-
-						if (seg_label_map.count(nlabels[nindex]) == 0)
+						else if (nlabels[ni] >= 0)
 						{
-							continue;
-							adjacent_label = -1;
-							break;
+							if (nlabels[ni] == label)
+								anchored = true;
+							else
+								adjlabel = nlabels[ni];
 						}
-						else if (seg_label_map[nlabels[nindex]]->index < pair.second->index)
+						else if (nlabels[ni] == -1 && klabels[ni] == label)
 						{
-							adjacent_label = nlabels[nindex];
+							nlabels[ni] = -2;
+							queue[count++] = ni;
 						}
 					}
 				}
-				if (adjacent_label == -1)
+
+				int final = label;
+				if (!anchored)
 				{
-					shrinked_area.push_back(pair);
+					if (count <= SUPSZ >> 2 && adjlabel >= 0)
+						final = adjlabel;
+					else if (m_labelcount[label] > 0)
+					{
+						final = numlabels++;
+						m_labelcount.push_back(0);
+					}
 				}
-				else
+				for (int c = 0; c < count; c++)
+					nlabels[queue[c]] = final;
+				m_labelcount[final] += count;
+			}
+		}
+	}
+
+	for (int t = 0; t < numtiles; t++)
+	{
+		const int tile = m_dirtytiles[t];
+		const int ty1 = (tile / tilesx) * tilesize, ty2 = min(height, ty1 + tilesize);
+		const int tx1 = (tile % tilesx) * tilesize, tx2 = min(width, tx1 + tilesize);
+		for (int y = ty1; y < ty2; y++)
+			for (int x = tx1; x < tx2; x++)
+				klabels[y * width + x] = nlabels[y * width + x];
+	}
+
+	//--------------------------------------------------
+	// Components of the labels that lost pixels
+	//--------------------------------------------------
+	const int sz = width * height;
+	for (int i = 0; i < sz; i++)
+	{
+		const int label = klabels[i];
+		if (label < numold && largest[label] != -2)
+			nlabels[i] = -1;
+	}
+	vector<area_info> &seg_info = m_seginfo;
+	seg_info.clear();
+	int end = 0; //components are stored one after the other in queue
+	for (int i = 0; i < sz; i++)
+	{
+		const int label = klabels[i];
+		if (label >= numold || largest[label] == -2 || nlabels[i] != -1)
+			continue;
+		const int s = seg_info.size();
+		area_info info;
+		info.index = end;
+		info.x = i % width;
+		info.y = i / width;
+		info.seg_label = label;
+		info.new_label = -1;
+		info.adjacent_index = -1;
+		queue[end++] = i;
+		nlabels[i] = s;
+		for (int c = info.index; c < end; c++)
+		{
+			const int cx = queue[c] % width;
+			const int cy = queue[c] / width;
+			for (int n = 0; n < 4; n++)
+			{
+				const int xx = cx + dx4[n];
+				const int yy = cy + dy4[n];
+				if (xx < 0 || xx >= width || yy < 0 || yy >= height)
+					continue;
+				const int ni = yy * width + xx;
+				if (nlabels[ni] == -1 && klabels[ni] == label)
 				{
-					seg_label_map[pair.first] = seg_label_map[adjacent_label];
+					nlabels[ni] = s;
+					queue[end++] = ni;
 				}
-				shrinked_area.pop_front();
 			}
 		}
+		info.count = end - info.index;
+		seg_info.push_back(info);
+		if (largest[label] < 0 || info.count > seg_info[largest[label]].count)
+			largest[label] = s;
+	}
 
-// Map old label to new label
-#pragma omp barrier
-#pragma omp for simd
-		for (size_t i = 0; i < sz; i++)
+	// The largest component keeps its label and the other large ones get a
+	// new one, before any small one looks for a neighbour
+	const int numseg = seg_info.size();
+	for (int s = 0; s < numseg; s++)
+	{
+		area_info &info = seg_info[s];
+		if (largest[info.seg_label] == s)
+			info.new_label = info.seg_label;
+		else if (info.count > SUPSZ >> 2)
 		{
-			labels[i] = seg_label_map[nlabels[i]]->new_label;
+			info.new_label = numlabels++;
+			m_labelcount.push_back(0);
 		}
 	}
 
-	numlabels = label;
+	// A small one takes the label of a neighbour whose label lost nothing,
+	// or of a component already settled: both are connected
+	for (int s = 0; s < numseg; s++)
+	{
+		area_info &info = seg_info[s];
+		for (int c = info.index; c < info.index + info.count && info.new_label < 0; c++)
+		{
+			const int cx = queue[c] % width;
+			const int cy = queue[c] / width;
+			for (int n = 0; n < 4; n++)
+			{
+				const int xx = cx + dx4[n];
+				const int yy = cy + dy4[n];
+				if (xx < 0 || xx >= width || yy < 0 || yy >= height)
+					continue;
+				const int ni = yy * width + xx;
+				const int other = klabels[ni];
+				if (other == info.seg_label)
+					continue;
+				if (other >= numold || largest[other] == -2)
+					info.new_label = other;
+				else if (seg_info[nlabels[ni]].new_label >= 0)
+					info.new_label = seg_info[nlabels[ni]].new_label;
+				if (info.new_label >= 0)
+					break;
+			}
+		}
+		if (info.new_label < 0)
+		{
+			info.new_label = numlabels++;
+			m_labelcount.push_back(0);
+		}
+	}
+
+	for (int s = 0; s < numseg; s++)
+	{
+		const area_info &info = seg_info[s];
+		if (info.new_label == info.seg_label)
+			continue;
+		for (int c = info.index; c < info.index + info.count; c++)
+			klabels[queue[c]] = info.new_label;
+		m_labelcount[info.seg_label] -= info.count;
+		m_labelcount[info.new_label] += info.count;
+	}
 }
 
 //===========================================================================
-///	PerformSLICO_ForGivenK
+///	PerformSLICO_Incremental
 ///
-/// Zero parameter SLIC algorithm for a given number K of superpixels.
+///	One frame of a mostly static stream. The work is in four steps, each
+/// proportional to the changed area except the change detection and a label
+/// scan in [4]:
+/// [1] flag the S x S tiles with changed pixels and convert only those,
+/// [2] mark as active the seeds whose 2S window reaches a changed tile, and
+///     as dirty every tile those windows reach, grown by one tile,
+/// [3] run the clustering on the dirty tiles, moving only the active seeds,
+/// [4] redo the connectivity of the dirty tiles against their surroundings,
+///     then split the labels that lost pixels there wherever they broke.
+/// An active seed's pixels all lie in the dirty tiles, so its centroid is the
+/// one a full assignment would give; the inactive seeds stay where they were.
 //===========================================================================
-void SLIC::PerformSLICO_ForGivenK(
+void SLIC::PerformSLICO_Incremental(
 	const unsigned int *ubuff,
 	const int width,
 	const int height,
 	int *klabels,
 	int &numlabels,
-	const int &K,	 //required number of superpixels
-	const double &m) //weight given to spatial distance
+	const int &K,
+	const double &m,
+	const unsigned char *changed,
+	const int &threshold)
 {
-	vector<double> kseedsl(0);
-	vector<double> kseedsa(0);
-	vector<double> kseedsb(0);
-	vector<double> kseedsx(0);
-	vector<double> kseedsy(0);
+	auto totalStart = Clock::now();
+	const int sz = width * height;
+	if (m_warm_K != K || m_warm_width != width || m_warm_height != height || m_rawlabels.size() != (size_t)sz)
+	{
+		m_keep_rawlabels = true;
+		PerformSLICO_ForGivenK(ubuff, width, height, klabels, numlabels, K, m);
+		m_keep_rawlabels = false;
+		InitIncrementalState(ubuff, klabels, numlabels);
+		return;
+	}
+
+	const int STEP = sqrt(double(sz) / double(K)) + 2.0;
+	int offset = STEP;
+	if (STEP < 10)
+		offset = STEP * 1.5;
+	const int tilesize = max(1, offset);
+	const int tilesx = (width + tilesize - 1) / tilesize;
+	const int tilesy = (height + tilesize - 1) / tilesize;
+	m_tileflags.assign(tilesx * tilesy, 0);
+	char *flags = m_tileflags.data();
 
 	//--------------------------------------------------
-	m_width = width;
-	m_height = height;
-	int sz = m_width * m_height;
+	// [1] Changed tiles, converted and remembered
 	//--------------------------------------------------
+	auto startTime = Clock::now();
+	const convert_argb_fn convert = Kernels().convert_argb;
+	const double *lut = rgb_lut;
+	const double *pow_lut = rgb_pow_lut;
+	const lab_t *table = m_use_lab_table ? GetRGBtoLABTable() : NULL;
+	unsigned int *prev = m_prevframe.data();
+
+	// m_labxy only follows the planes while the interleaved layout is on: pack
+	// the last frame's planes in full when it was off, or never allocated
+	if (!m_interleaved)
+		m_labxy_packed = false;
+	else if (!m_labxy_packed)
+	{
+		ReserveWorkspace(width, height);
+		PackLabPixels();
+	}
 
-	//--------------------------------------------------
-	// RGB2LAB
-	// Init LUT
-	for (size_t i = 0; i < 256; i++)
+#if _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int band = 0; band < tilesy; band++)
 	{
-		double tmp = i / 255.0;
-		rgb_lut[i] = tmp / 12.92;
-		rgb_pow_lut[i] = pow((tmp + 0.055) / 1.055, 2.4);
+		char *bandflags = flags + band * tilesx;
+		const int y1 = band * tilesize;
+		const int y2 = min(height, y1 + tilesize);
+		for (int y = y1; y < y2; y++)
+		{
+			const int row = y * width;
+			for (int x = 0; x < width; x++)
+			{
+				if (changed ? changed[row + x] != 0 : ChannelDelta(ubuff[row + x], prev[row + x]) > threshold)
+					bandflags[x / tilesize] = 1;
+			}
+		}
+		for (int c = 0; c < tilesx; c++)
+		{
+			if (!bandflags[c])
+				continue;
+			const int x1 = c * tilesize;
+			const int n = min(width, x1 + tilesize) - x1;
+			for (int y = y1; y < y2; y++)
+			{
+				const int i = y * width + x1;
+				convert(ubuff + i, n, lut, pow_lut, table, m_lvec + i, m_avec + i, m_bvec + i);
+				std::copy(ubuff + i, ubuff + i + n, prev + i);
+				if (m_interleaved)
+				{
+					for (int j = i; j < i + n; j++)
+					{
+						m_labxy[j].l = m_lvec[j];
+						m_labxy[j].a = m_avec[j];
+						m_labxy[j].b = m_bvec[j];
+					}
+				}
+			}
+		}
 	}
+	m_stats.rgb2lab_ms = ElapsedMs(startTime, Clock::now());
 
-	// Convert
+	//--------------------------------------------------
+	// [2] Active seeds and dirty tiles
+	//--------------------------------------------------
+	startTime = Clock::now();
+	const int numk = m_kseedsl.size();
+	m_activeseeds.assign(numk, 0);
+	int numactive = 0;
+	for (int n = 0; n < numk; n++)
+	{
+		const int x1 = max(0, (int)(m_kseedsx[n] - offset));
+		const int x2 = min(width, (int)(m_kseedsx[n] + offset));
+		const int y1 = max(0, (int)(m_kseedsy[n] - offset));
+		const int y2 = min(height, (int)(m_kseedsy[n] + offset));
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+		for (int ty = y1 / tilesize; ty <= (y2 - 1) / tilesize && !m_activeseeds[n]; ty++)
+			for (int tx = x1 / tilesize; tx <= (x2 - 1) / tilesize; tx++)
+				if (flags[ty * tilesx + tx] & 1)
+					m_activeseeds[n] = 1;
+		if (!m_activeseeds[n])
+			continue;
+		numactive++;
+		const int ty1 = max(0, y1 / tilesize - 1), ty2 = min(tilesy - 1, (y2 - 1) / tilesize + 1);
+		const int tx1 = max(0, x1 / tilesize - 1), tx2 = min(tilesx - 1, (x2 - 1) / tilesize + 1);
+		for (int ty = ty1; ty <= ty2; ty++)
+			for (int tx = tx1; tx <= tx2; tx++)
+				flags[ty * tilesx + tx] |= 2;
+	}
+	m_dirtytiles.clear();
+	long long dirty = 0;
+	for (int t = 0; t < tilesx * tilesy; t++)
 	{
-		auto startTime = Clock::now();
-		DoRGBtoLABConversion(ubuff, m_lvec, m_avec, m_bvec);
-		auto endTime = Clock::now();
-		auto compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
-		std::cout << "RGB2LAB Conversion time: " << (double)compTime.count() / 1000 << " ms" << endl;
+		if (flags[t] & 1)
+			flags[t] |= 2;
+		if (flags[t] & 2)
+		{
+			m_dirtytiles.push_back(t);
+			dirty += (long long)(min(height, (t / tilesx + 1) * tilesize) - (t / tilesx) * tilesize) *
+					 (min(width, (t % tilesx + 1) * tilesize) - (t % tilesx) * tilesize);
+		}
 	}
+	m_stats.seeds_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.seeds = numactive;
+	m_stats.pixels = sz;
+	m_stats.dirty = dirty;
+	m_stats.warm = true;
+	m_stats.isa = Kernels().isa;
 
 	//--------------------------------------------------
+	// [3] Clustering on the dirty tiles
+	//--------------------------------------------------
+	startTime = Clock::now();
+	m_stats.iterations = 0;
+	m_stats.residual = 0;
+	m_stats.distances = 0;
+	m_stats.assign_ms.clear();
+	m_stats.update_ms.clear();
+	if (!m_dirtytiles.empty())
+	{
+		PerformSuperpixelSegmentation_VariableSandM(m_kseedsl, m_kseedsa, m_kseedsb, m_kseedsx, m_kseedsy,
+													m_rawlabels.data(), STEP, m_maxitr, true, &m_dirtytiles, &m_activeseeds);
+	}
+	m_stats.segmentation_ms = ElapsedMs(startTime, Clock::now());
 
-	bool perturbseeds(true);
-	vector<double> edgemag(0);
+	//--------------------------------------------------
+	// [4] Connectivity of the dirty tiles
+	//--------------------------------------------------
+	startTime = Clock::now();
+	numlabels = m_labelcount.size();
+	EnforceDirtyTileConnectivity(klabels, tilesize, numlabels, K);
+	for (int n = 0; n < numk; n++)
+	{
+		const int x = m_kseedsx[n] + 0.5;
+		const int y = m_kseedsy[n] + 0.5;
+		if (m_activeseeds[n] && x >= 0 && x < width && y >= 0 && y < height && m_rawlabels[y * width + x] == n)
+			m_seedlabel[n] = klabels[y * width + x];
+	}
+	m_stats.connectivity_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.labels = numlabels;
+
+	m_stats.total_ms = ElapsedMs(totalStart, Clock::now());
+	if (m_verbose)
+		PrintStats(std::cout);
+}
+
+//===========================================================================
+///	ReadRowsAt / WriteRowsAt
+///
+///	Positioned I/O on the out of core temporary files.
+//===========================================================================
+static inline bool ReadRowsAt(FILE *file, const long long &offset, void *dst, const size_t &bytes)
+{
+	return fseeko(file, offset, SEEK_SET) == 0 && fread(dst, 1, bytes, file) == bytes;
+}
+
+static inline bool WriteRowsAt(FILE *file, const long long &offset, const void *src, const size_t &bytes)
+{
+	return fseeko(file, offset, SEEK_SET) == 0 && fwrite(src, 1, bytes, file) == bytes;
+}
+
+//===========================================================================
+///	GetLABXYSeeds_OutOfCore
+///
+///	First pass: read, convert and store each band of Lab rows, planes one
+/// after the other within the band, and seed GetLABXYSeeds_ForGivenK's hex
+/// grid on the way. A seed's perturbation reads the rows two above to two
+/// below it, so the last four rows of a band are kept with the next one and
+/// a seed is placed once the rows two below it are in.
+//===========================================================================
+bool SLIC::GetLABXYSeeds_OutOfCore(
+	read_rows_fn read,
+	void *user,
+	const int &bandrows,
+	FILE *labfile,
+	const int &K)
+{
+	const int dx8[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+	const int dy8[8] = {0, -1, -1, -1, 0, 1, 1, 1};
+	const int keep = 4;
+
+	const int width = m_width;
+	const int height = m_height;
+	const double step = sqrt(double(width) * height / double(K));
+	const int xoff = step / 2;
+	const int yoff = step / 2;
+
+	// The hex grid rows, as GetLABXYSeeds_ForGivenK counts them
+	vector<int> &rowstart = m_seedrows;
+	rowstart.assign(1, 0);
+	for (int y = 0; y < height; y++)
+	{
+		int Y = y * step + yoff;
+		if (Y > height - 1)
+			break;
+		int count = 0;
+		for (int x = 0; x < width; x++)
+		{
+			int X = x * step + (xoff << (y & 0x1)); //hex grid
+			if (X > width - 1)
+				break;
+			count++;
+		}
+		rowstart.push_back(rowstart.back() + count);
+	}
+	const int numrows = rowstart.size() - 1;
+	const int numseeds = rowstart[numrows];
+	m_kseedsl.resize(numseeds);
+	m_kseedsa.resize(numseeds);
+	m_kseedsb.resize(numseeds);
+	m_kseedsx.resize(numseeds);
+	m_kseedsy.resize(numseeds);
+
+	const convert_argb_fn convert = Kernels().convert_argb;
+	const double *lut = rgb_lut;
+	const double *pow_lut = rgb_pow_lut;
+	const lab_t *table = m_use_lab_table ? GetRGBtoLABTable() : NULL;
+
+	// Rows [w0, y1) of the image: up to keep rows of the last band, then this one
+	const size_t planesize = (size_t)(bandrows + keep) * width;
+	vector<unsigned int> argb((size_t)bandrows * width);
+	vector<lab_t> window(3 * planesize);
+	lab_t *lwin = window.data();
+	lab_t *awin = lwin + planesize;
+	lab_t *bwin = awin + planesize;
+
+	int nextrow = 0; //first hex grid row not seeded yet
+	int w0 = 0;
+	for (int y0 = 0; y0 < height; y0 += bandrows)
+	{
+		const int y1 = min(height, y0 + bandrows);
+		const int rows = y1 - y0;
+		if (y0 > 0)
+		{
+			// Slide the kept rows to the top of the window
+			const int kept = min(keep, y0 - w0);
+			const size_t from = (size_t)(y0 - kept - w0) * width;
+			memmove(lwin, lwin + from, (size_t)kept * width * sizeof(lab_t));
+			memmove(awin, awin + from, (size_t)kept * width * sizeof(lab_t));
+			memmove(bwin, bwin + from, (size_t)kept * width * sizeof(lab_t));
+			w0 = y0 - kept;
+		}
+		read(user, y0, rows, argb.data());
+
+		const size_t band = (size_t)(y0 - w0) * width;
+#if _OPENMP
+#pragma omp parallel for
+#endif
+		for (int y = 0; y < rows; y++)
+		{
+			const size_t row = (size_t)y * width;
+			convert(argb.data() + row, width, lut, pow_lut, table, lwin + band + row, awin + band + row, bwin + band + row);
+		}
+
+		const size_t bytes = (size_t)rows * width * sizeof(lab_t);
+		const long long at = (long long)y0 * width * 3 * sizeof(lab_t);
+		if (!WriteRowsAt(labfile, at, lwin + band, bytes) ||
+			!WriteRowsAt(labfile, at + bytes, awin + band, bytes) ||
+			!WriteRowsAt(labfile, at + 2 * bytes, bwin + band, bytes))
+		{
+			return false;
+		}
+
+		// Seeds whose perturbation stencil is now complete, as PerturbSeeds
+		// places them with a lazy edge map
+		int lastrow = nextrow;
+		while (lastrow < numrows && (y1 == height || (int)(lastrow * step + yoff) < y1 - 2))
+			lastrow++;
+#if _OPENMP
+#pragma omp parallel for
+#endif
+		for (int n = rowstart[nextrow]; n < rowstart[lastrow]; n++)
+		{
+			const int r = std::upper_bound(rowstart.begin(), rowstart.end(), n) - rowstart.begin() - 1;
+			const int oy = r * step + yoff;
+			const int ox = (n - rowstart[r]) * step + (xoff << (r & 0x1)); //hex grid
+
+			int sx = ox;
+			int sy = oy;
+			double storeedge = 0;
+			for (int i = -1; i < 8; i++)
+			{
+				const int nx = i < 0 ? ox : ox + dx8[i];
+				const int ny = i < 0 ? oy : oy + dy8[i];
+				if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+					continue;
+				double nedge = 0;
+				if (nx > 0 && nx < width - 1 && ny > 0 && ny < height - 1)
+					nedge = LabPixelEdge(lwin, awin, bwin, (ny - w0) * width + nx, width);
+				if (i < 0 || nedge < storeedge)
+				{
+					sx = nx;
+					sy = ny;
+					storeedge = nedge;
+				}
+			}
+			const size_t i = (size_t)(sy - w0) * width + sx;
+			m_kseedsl[n] = lwin[i];
+			m_kseedsa[n] = awin[i];
+			m_kseedsb[n] = bwin[i];
+			m_kseedsx[n] = sx;
+			m_kseedsy[n] = sy;
+		}
+		nextrow = lastrow;
+	}
+	return true;
+}
+
+//===========================================================================
+///	PerformSuperpixelSegmentation_OutOfCore
+///
+///	PerformSuperpixelSegmentation_VariableSandM with the row schedule, one
+/// band at a time: each iteration reads every band's Lab rows and labels,
+/// assigns and accumulates them, and writes the labels back. The per thread
+/// sums carry over from band to band, so the seeds move exactly as they
+/// would in memory.
+//===========================================================================
+bool SLIC::PerformSuperpixelSegmentation_OutOfCore(
+	const int &bandrows,
+	FILE *labfile,
+	FILE *labelfile,
+	const int &STEP,
+	const int &NUMITR)
+{
+	vector<double> &kseedsl = m_kseedsl;
+	vector<double> &kseedsa = m_kseedsa;
+	vector<double> &kseedsb = m_kseedsb;
+	vector<double> &kseedsx = m_kseedsx;
+	vector<double> &kseedsy = m_kseedsy;
+	const int numk = kseedsl.size();
+	const int width = m_width;
+	const int height = m_height;
+
+	int offset = STEP;
+	if (STEP < 10)
+		offset = STEP * 1.5;
+
+	vector<double> &maxlab = m_maxlab;
+	maxlab.assign(numk, 10 * 10); //THIS IS THE VARIABLE VALUE OF M, just start with 10
+	const lab_t invxywt = 1.0 / (STEP * STEP);
+
+	const int bandheight = max(1, offset);
+	const int numbands = (height + bandheight - 1) / bandheight;
+	vector<int> &bandstart = m_bandstart;
+	vector<int> &bandseeds = m_bandseeds;
+	bandstart.resize(numbands + 1);
+
+	const assign_row_fn AssignRow = Kernels().assign_row;
+	vector<lab_seed> &seeds = m_seeds;
+	seeds.resize(numk);
+	const int maxthreads = omp_get_max_threads();
+	ReserveClusterSums((size_t)maxthreads * numk);
+	ReserveDistanceRows((size_t)maxthreads * width);
+
+	const size_t planesize = (size_t)bandrows * width;
+	vector<lab_t> planes(3 * planesize);
+	vector<int> labels(planesize);
+
+	m_stats.assign_ms.clear();
+	m_stats.update_ms.clear();
+	long long distances = 0;
+
+	for (int numitr = 0; numitr < NUMITR; numitr++)
+	{
+		Clock::time_point assignStart = Clock::now();
+		BuildSeedBands(kseedsx, kseedsy, width, height, offset, bandheight, width, bandstart, bandseeds);
+		for (int n = 0; n < numk; n++)
+		{
+			seeds[n].l = kseedsl[n];
+			seeds[n].a = kseedsa[n];
+			seeds[n].b = kseedsb[n];
+			seeds[n].x = kseedsx[n];
+			seeds[n].y = kseedsy[n];
+			seeds[n].maxlab = maxlab[n];
+		}
+		for (size_t k = 0; k < (size_t)maxthreads * numk; k++)
+		{
+			cluster_sum &sum = m_clustersums[k];
+			sum.l = sum.a = sum.b = 0;
+			sum.x = sum.y = 0;
+			sum.maxlab = 0;
+			sum.count = 0;
+		}
+
+		for (int y0 = 0; y0 < height; y0 += bandrows)
+		{
+			const int rows = min(height, y0 + bandrows) - y0;
+			const size_t bytes = (size_t)rows * width * sizeof(lab_t);
+			const long long at = (long long)y0 * width * 3 * sizeof(lab_t);
+			const long long labelat = (long long)y0 * width * sizeof(int);
+			lab_t *lband = planes.data();
+			lab_t *aband = lband + planesize;
+			lab_t *bband = aband + planesize;
+			if (!ReadRowsAt(labfile, at, lband, bytes) ||
+				!ReadRowsAt(labfile, at + bytes, aband, bytes) ||
+				!ReadRowsAt(labfile, at + 2 * bytes, bband, bytes))
+			{
+				return false;
+			}
+			if (numitr == 0)
+				std::fill(labels.begin(), labels.end(), -1);
+			else if (!ReadRowsAt(labelfile, labelat, labels.data(), (size_t)rows * width * sizeof(int)))
+				return false;
+
+#if _OPENMP
+#pragma omp parallel reduction(+ \
+							   : distances)
+#endif
+			{
+				const int thread_id = omp_get_thread_num();
+				cluster_sum *sums = m_clustersums + (size_t)thread_id * numk;
+				lab_t *distlab = m_distlab + (size_t)thread_id * width;
+				lab_t *distvec = m_distvec + (size_t)thread_id * width;
+
+#pragma omp for schedule(guided)
+				for (int r = 0; r < rows; r++)
+				{
+					const int y = y0 + r;
+					const int tile = y / bandheight;
+					const size_t row = (size_t)r * width;
+					for (int x = 0; x < width; x++)
+						distvec[x] = LAB_MAX;
+
+					const planar_row band = {lband + row, aband + row, bband + row};
+					for (int s = bandstart[tile]; s < bandstart[tile + 1]; s++)
+					{
+						const int n = bandseeds[s];
+						const lab_seed &sd = seeds[n];
+						if (!((int)(sd.y - offset) <= y && y < (int)(sd.y + offset)))
+						{
+							continue;
+						}
+
+						const int x1 = max(0, (int)(sd.x - offset));
+						const int x2 = min(width, (int)(sd.x + offset));
+						distances += max(0, x2 - x1);
+
+						assign_seed seed;
+						seed.l = sd.l;
+						seed.a = sd.a;
+						seed.b = sd.b;
+						seed.x = sd.x;
+						seed.cons_y = (y - sd.y) * (y - sd.y);
+						seed.inv_maxlab = 1 / sd.maxlab;
+						seed.invxywt = invxywt;
+						seed.n = n;
+						AssignRow(band, distlab, distvec, labels.data() + row, x1, x2, seed);
+					}
+					AccumulateRow(band, distlab, labels.data() + row, 0, width, y, sums);
+				}
+			}
+
+			if (!WriteRowsAt(labelfile, labelat, labels.data(), (size_t)rows * width * sizeof(int)))
+				return false;
+		}
+
+		Clock::time_point updateStart = Clock::now();
+		double residual = 0;
+#if _OPENMP
+#pragma omp parallel for reduction(+ \
+								   : residual)
+#endif
+		for (int k = 0; k < numk; k++)
+		{
+			cluster_sum total = m_clustersums[k];
+			for (int t = 1; t < maxthreads; t++)
+			{
+				const cluster_sum &sum = m_clustersums[(size_t)t * numk + k];
+				total.l += sum.l;
+				total.a += sum.a;
+				total.b += sum.b;
+				total.x += sum.x;
+				total.y += sum.y;
+				total.maxlab = max(total.maxlab, sum.maxlab);
+				total.count += sum.count;
+			}
+			maxlab[k] = max(maxlab[k], total.maxlab);
+			if (total.count == 0 && m_warm)
+				continue; // as PerformSuperpixelSegmentation_VariableSandM
+
+			const double inv = 1.0 / double(total.count);
+			const double newx = total.x * inv;
+			const double newy = total.y * inv;
+			if (total.count > 0)
+				residual += sqrt((newx - kseedsx[k]) * (newx - kseedsx[k]) + (newy - kseedsy[k]) * (newy - kseedsy[k]));
+
+			kseedsl[k] = total.l * inv;
+			kseedsa[k] = total.a * inv;
+			kseedsb[k] = total.b * inv;
+			kseedsx[k] = newx;
+			kseedsy[k] = newy;
+		}
+
+		Clock::time_point updateEnd = Clock::now();
+		m_stats.assign_ms.push_back(ElapsedMs(assignStart, updateStart));
+		m_stats.update_ms.push_back(ElapsedMs(updateStart, updateEnd));
+		m_stats.residual = numk > 0 ? residual / numk / STEP : 0;
+		m_stats.iterations = numitr + 1;
+		if (m_threshold > 0 && m_stats.residual < m_threshold)
+			break;
+	}
+	m_stats.distances = distances;
+	return true;
+}
+
+//===========================================================================
+///	EnforceLabelConnectivity_OutOfCore
+///
+///	The raster order flood fill EnforceLabelConnectivity reproduces, over a
+/// window that slides down the image. A seed only takes pixels inside its
+/// 2S window, so a component spans at most halo rows: once the components
+/// starting in one band are filled, reaching at most halo rows below it,
+/// the band is final and is written out. The window holds the row above the
+/// band, the band and the halo, labels and final labels.
+//===========================================================================
+bool SLIC::EnforceLabelConnectivity_OutOfCore(
+	write_rows_fn write,
+	void *user,
+	const int &bandrows,
+	FILE *labelfile,
+	const int &halo,
+	int &numlabels,
+	const int &K)
+{
+	const int dx4[4] = {-1, 0, 1, 0};
+	const int dy4[4] = {0, -1, 0, 1};
+
+	const int width = m_width;
+	const int height = m_height;
+	const long long SUPSZ = (long long)width * height / K;
+	const int maxrows = 1 + bandrows + halo;
+	vector<int> labels((size_t)maxrows * width);
+	vector<int> nlabels((size_t)maxrows * width);
+	vector<int> queue((size_t)maxrows * width);
+
+	int w0 = 0; //first row in the window
+	int w1 = 0; //one past the last row in the window
+	int label = 0;
+	int adjlabel = 0; //adjacent label
+	for (int y0 = 0; y0 < height; y0 += bandrows)
+	{
+		const int y1 = min(height, y0 + bandrows);
+
+		// Keep the row above the band, load the rows down to the halo
+		const int top = max(0, y0 - 1);
+		if (top > w0)
+		{
+			const size_t from = (size_t)(top - w0) * width;
+			const size_t count = (size_t)(w1 - top) * width;
+			memmove(labels.data(), labels.data() + from, count * sizeof(int));
+			memmove(nlabels.data(), nlabels.data() + from, count * sizeof(int));
+			w0 = top;
+		}
+		const int end = min(height, y1 + halo);
+		if (end > w1)
+		{
+			const size_t at = (size_t)(w1 - w0) * width;
+			const size_t count = (size_t)(end - w1) * width;
+			if (!ReadRowsAt(labelfile, (long long)w1 * width * sizeof(int), labels.data() + at, count * sizeof(int)))
+				return false;
+			std::fill(nlabels.begin() + at, nlabels.begin() + at + count, -1);
+			w1 = end;
+		}
+
+		const int *lab = labels.data();
+		int *nlab = nlabels.data();
+		int *q = queue.data();
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const int oindex = (y - w0) * width + x;
+				if (nlab[oindex] >= 0)
+					continue;
+				nlab[oindex] = label;
+
+				//--------------------
+				// Quickly find an adjacent label for use later if needed
+				//--------------------
+				for (int n = 0; n < 4; n++)
+				{
+					const int xx = x + dx4[n], yy = y + dy4[n];
+					if (xx >= 0 && xx < width && yy >= w0 && yy < w1)
+					{
+						const int nindex = (yy - w0) * width + xx;
+						if (nlab[nindex] >= 0)
+							adjlabel = nlab[nindex];
+					}
+				}
+
+				int count = 1;
+				q[0] = oindex;
+				for (int c = 0; c < count; c++)
+				{
+					const int cx = q[c] % width;
+					const int cy = q[c] / width + w0;
+					for (int n = 0; n < 4; n++)
+					{
+						const int xx = cx + dx4[n], yy = cy + dy4[n];
+						if (xx >= 0 && xx < width && yy >= w0 && yy < w1)
+						{
+							const int nindex = (yy - w0) * width + xx;
+							if (nlab[nindex] < 0 && lab[oindex] == lab[nindex])
+							{
+								q[count++] = nindex;
+								nlab[nindex] = label;
+							}
+						}
+					}
+				}
+
+				//-------------------------------------------------------
+				// If segment size is less then a limit, assign an
+				// adjacent label found before, and decrement label count.
+				//-------------------------------------------------------
+				if (count <= SUPSZ >> 2)
+				{
+					for (int c = 0; c < count; c++)
+						nlab[q[c]] = adjlabel;
+					label--;
+				}
+				label++;
+			}
+		}
+		write(user, y0, y1 - y0, nlab + (size_t)(y0 - w0) * width);
+	}
+	numlabels = label;
+	return true;
+}
+
+//===========================================================================
+///	PerformSLICO_OutOfCore
+///
+///	PerformSLICO_ForGivenK in three streamed passes over the image, with the
+/// Lab rows and the labels in temporary files: 3 lab_t and one int per
+/// pixel on disk, a few bands of rows and the seeds in memory. The seeding,
+/// the clustering and the connectivity are the in memory ones reordered by
+/// band, hence the same labels.
+//===========================================================================
+bool SLIC::PerformSLICO_OutOfCore(
+	read_rows_fn read,
+	write_rows_fn write,
+	void *user,
+	const int width,
+	const int height,
+	const int &bandrows,
+	int &numlabels,
+	const int &K,
+	const double &m)
+{
+	auto totalStart = Clock::now();
+	m_width = width;
+	m_height = height;
+	m_warm_K = 0; //nothing here to start the next frame from
+	m_rawlabels.clear();
+	const int rows = max(1, min(bandrows, height));
+
+	FILE *labfile = tmpfile();
+	FILE *labelfile = tmpfile();
+	bool ok = labfile && labelfile;
+
+	InitRGBtoLABLUT();
+	auto startTime = Clock::now();
+	ok = ok && GetLABXYSeeds_OutOfCore(read, user, rows, labfile, K);
+	m_stats.rgb2lab_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.seeds_ms = 0; //placed while converting
+	m_stats.seeds = m_kseedsl.size();
+	m_stats.pixels = (long long)width * height;
+	m_stats.dirty = m_stats.pixels;
+	m_stats.warm = false;
+	m_stats.isa = Kernels().isa;
+
+	int STEP = sqrt(double(width) * height / double(K)) + 2.0;
+	int offset = STEP;
+	if (STEP < 10)
+		offset = STEP * 1.5;
+	startTime = Clock::now();
+	ok = ok && PerformSuperpixelSegmentation_OutOfCore(rows, labfile, labelfile, STEP, m_maxitr);
+	m_stats.segmentation_ms = ElapsedMs(startTime, Clock::now());
+
+	startTime = Clock::now();
+	ok = ok && EnforceLabelConnectivity_OutOfCore(write, user, rows, labelfile, 2 * offset, numlabels, K);
+	m_stats.connectivity_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.labels = numlabels;
+
+	if (labfile)
+		fclose(labfile);
+	if (labelfile)
+		fclose(labelfile);
+	m_stats.total_ms = ElapsedMs(totalStart, Clock::now());
+	if (ok && m_verbose)
+		PrintStats(std::cout);
+	return ok;
+}
+
+//===========================================================================
+///	PerformSLICO_OnLAB
+///
+/// Seeding, clustering and connectivity on the Lab planes already held in
+/// m_lvec, m_avec and m_bvec.
+///
+/// With SetWarmStart, a run on the same size and K as the last one skips the
+/// seeding: the centroids and maxlab the last run converged to are still in
+/// m_kseeds* and m_maxlab and become this frame's starting point.
+//===========================================================================
+void SLIC::PerformSLICO_OnLAB(
+	int *klabels,
+	int &numlabels,
+	const int &K,
+	const double &m)
+{
+	vector<double> &kseedsl = m_kseedsl;
+	vector<double> &kseedsa = m_kseedsa;
+	vector<double> &kseedsb = m_kseedsb;
+	vector<double> &kseedsx = m_kseedsx;
+	vector<double> &kseedsy = m_kseedsy;
+	const bool warm = m_warm && m_warm_K == K && m_warm_width == m_width && m_warm_height == m_height;
+	if (!warm)
+	{
+		kseedsl.clear();
+		kseedsa.clear();
+		kseedsb.clear();
+		kseedsx.clear();
+		kseedsy.clear();
+	}
+
+	int sz = m_width * m_height;
+	m_stats.pixels = sz;
+	m_stats.warm = warm;
+
+	if (m_interleaved)
+	{
+		// Counted with the conversion it extends
+		auto packStart = Clock::now();
+		ReserveWorkspace(m_width, m_height);
+		PackLabPixels();
+		m_stats.rgb2lab_ms += ElapsedMs(packStart, Clock::now());
+	}
+	else
+		m_labxy_packed = false;
+	m_stats.isa = Kernels().isa;
+
+	//--------------------------------------------------
+	bool perturbseeds(true);
+	vector<double> edgemag(0);
 	// if (perturbseeds)
 	// {
-
-	// 	auto startTime = Clock::now();
 	// 	DetectLabEdges(m_lvec, m_avec, m_bvec, m_width, m_height, edgemag);
-	// 	auto endTime = Clock::now();
-	// 	auto compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
-	// 	std::cout << "DetectLabEdges time: " << (double)compTime.count() / 1000 << " ms" << endl;
 	// }
 	auto startTime = Clock::now();
-	GetLABXYSeeds_ForGivenK(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, K, perturbseeds, edgemag);
-	auto endTime = Clock::now();
-	auto compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
-	std::cout << "GetLABXYSeeds time: " << (double)compTime.count() / 1000 << " ms" << endl;
+	if (!warm)
+		GetLABXYSeeds_ForGivenK(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, K, perturbseeds, edgemag);
+	m_stats.seeds_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.seeds = kseedsl.size();
 
 	int STEP = sqrt(double(sz) / double(K)) + 2.0; //adding a small value in the even the STEP size is too small.
 	startTime = Clock::now();
-	PerformSuperpixelSegmentation_VariableSandM(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, klabels, STEP, 10);
-	endTime = Clock::now();
-	compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
-	std::cout << "SuperpixelSegmentation time=" << compTime.count() / 1000 << " ms" << endl;
+	PerformSuperpixelSegmentation_VariableSandM(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, klabels, STEP, m_maxitr, warm, NULL, NULL);
+	m_stats.segmentation_ms = ElapsedMs(startTime, Clock::now());
 	numlabels = kseedsl.size();
+	m_warm_width = m_width;
+	m_warm_height = m_height;
+	m_warm_K = K;
+	m_stats.dirty = sz;
+	if (m_keep_rawlabels)
+		m_rawlabels.assign(klabels, klabels + sz);
+	else
+		m_rawlabels.clear();
+
+	startTime = Clock::now();
+	EnforceLabelConnectivity(klabels, m_width, m_height, m_nlabels.data(), numlabels, K);
+	m_stats.connectivity_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.labels = numlabels;
+}
+
+//===========================================================================
+///	ReserveSupervoxelWorkspace
+///
+///	Lab slices for a width x height x depth volume. They are kept while the
+/// depth stays the same and the slices are large enough.
+//===========================================================================
+void SLIC::ReserveSupervoxelWorkspace(const int &width, const int &height, const int &depth)
+{
+	const size_t sz = (size_t)width * height;
+	if (m_lvecvec && (depth != m_depth || sz > m_slice_size))
+	{
+		for (int d = 0; d < m_depth; d++)
+		{
+			delete[] m_lvecvec[d];
+			delete[] m_avecvec[d];
+			delete[] m_bvecvec[d];
+		}
+		delete[] m_lvecvec;
+		delete[] m_avecvec;
+		delete[] m_bvecvec;
+		m_lvecvec = m_avecvec = m_bvecvec = NULL;
+	}
+	if (!m_lvecvec)
+	{
+		m_lvecvec = new lab_t *[depth];
+		m_avecvec = new lab_t *[depth];
+		m_bvecvec = new lab_t *[depth];
+		for (int d = 0; d < depth; d++)
+		{
+			m_lvecvec[d] = new lab_t[sz];
+			m_avecvec[d] = new lab_t[sz];
+			m_bvecvec[d] = new lab_t[sz];
+		}
+		m_depth = depth;
+		m_slice_size = sz;
+	}
+	if (m_nlabels.size() < sz * depth)
+		m_nlabels.resize(sz * depth);
+	if (m_voxelqueue.size() < sz * depth)
+		m_voxelqueue.resize(sz * depth);
+}
+
+//===========================================================================
+///	GetLABXYZSeeds_ForGivenK
+///
+/// Seeds on a regular grid of about K cells, one at the centre of each cell,
+/// in raster order (z, then y, then x). The cells are cubes of side
+/// cbrt(volume / K) unless the stack is thinner than that; the slices are
+/// then split into fewer layers and the spacing within a slice grows to keep
+/// about K seeds. Returns that spacing.
+//===========================================================================
+double SLIC::GetLABXYZSeeds_ForGivenK(const int &K)
+{
+	const int width = m_width;
+	const int height = m_height;
+	const int depth = m_depth;
+	const int zstrips = max(1, (int)(0.5 + depth / cbrt(double(width) * height * depth / double(K))));
+	const double step = sqrt(double(width) * height * zstrips / double(K));
+
+	const int xstrips = max(1, (int)(0.5 + width / step));
+	const int ystrips = max(1, (int)(0.5 + height / step));
+	const double xspacing = double(width) / xstrips;
+	const double yspacing = double(height) / ystrips;
+	const double zspacing = double(depth) / zstrips;
+
+	const int numseeds = xstrips * ystrips * zstrips;
+	m_kseedsl.resize(numseeds);
+	m_kseedsa.resize(numseeds);
+	m_kseedsb.resize(numseeds);
+	m_kseedsx.resize(numseeds);
+	m_kseedsy.resize(numseeds);
+	m_kseedsz.resize(numseeds);
+
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int n = 0; n < numseeds; n++)
+	{
+		const int X = (n % xstrips) * xspacing + xspacing / 2;
+		const int Y = (n / xstrips % ystrips) * yspacing + yspacing / 2;
+		const int Z = (n / xstrips / ystrips) * zspacing + zspacing / 2;
+		const int i = Y * width + X;
+
+		m_kseedsl[n] = m_lvecvec[Z][i];
+		m_kseedsa[n] = m_avecvec[Z][i];
+		m_kseedsb[n] = m_bvecvec[Z][i];
+		m_kseedsx[n] = X;
+		m_kseedsy[n] = Y;
+		m_kseedsz[n] = Z;
+	}
+	return step;
+}
+
+//===========================================================================
+///	PerformSupervoxelSegmentation_VariableSandM
+///
+///	PerformSuperpixelSegmentation_VariableSandM in three dimensions. Each
+/// image row of each slice is one unit of work; seeds are binned by z and y
+/// so a row only visits the seeds whose window reaches it, and the z offset
+/// folds into the per row constant of the 2D kernels.
+//===========================================================================
+void SLIC::PerformSupervoxelSegmentation_VariableSandM(
+	int **klabels,
+	const int &STEP,
+	const int &NUMITR)
+{
+	const int width = m_width;
+	const int height = m_height;
+	const int depth = m_depth;
+	vector<double> &kseedsl = m_kseedsl;
+	vector<double> &kseedsa = m_kseedsa;
+	vector<double> &kseedsb = m_kseedsb;
+	vector<double> &kseedsx = m_kseedsx;
+	vector<double> &kseedsy = m_kseedsy;
+	vector<double> &kseedsz = m_kseedsz;
+	const int numk = kseedsl.size();
+
+	//----------------
+	int offset = STEP;
+	if (STEP < 10)
+		offset = STEP * 1.5;
+	//----------------
+
+	vector<double> &maxlab = m_maxlab;
+	maxlab.assign(numk, 10 * 10); //THIS IS THE VARIABLE VALUE OF M, just start with 10
+
+	const lab_t invxywt = 1.0 / (STEP * STEP);
+
+	// Tiles of the (y, z) plane, one per band of slices and band of rows
+	const int bandheight = max(1, offset);
+	const int ybands = (height + bandheight - 1) / bandheight;
+	const int zbands = (depth + bandheight - 1) / bandheight;
+	vector<int> &bandstart = m_bandstart;
+	vector<int> &bandseeds = m_bandseeds;
+	bandstart.resize(zbands * ybands + 1);
+
+	const assign_row_fn AssignRow = Kernels().assign_row;
+	const int maxthreads = omp_get_max_threads();
+	ReserveClusterSums((size_t)maxthreads * numk);
+	ReserveDistanceRows((size_t)maxthreads * width);
+
+	m_stats.assign_ms.clear();
+	m_stats.update_ms.clear();
+	long long distances = 0;
+	const int rows = depth * height;
+
+	for (int numitr = 0; numitr < NUMITR; numitr++)
+	{
+		Clock::time_point assignStart = Clock::now();
+		Clock::time_point updateStart;
+		BuildSeedBands(kseedsy, kseedsz, height, depth, offset, bandheight, bandheight, bandstart, bandseeds);
+		double residual = 0;
+
+#if _OPENMP
+#pragma omp parallel reduction(+ \
+							   : distances)
+#endif
+		{
+			const int thread_id = omp_get_thread_num();
+			const int thread_num = omp_get_num_threads();
+			cluster_sum *sums = m_clustersums + (size_t)thread_id * numk;
+			lab_t *distlab = m_distlab + (size_t)thread_id * width;
+			lab_t *distvec = m_distvec + (size_t)thread_id * width;
+			for (int k = 0; k < numk; k++)
+			{
+				sums[k].l = sums[k].a = sums[k].b = 0;
+				sums[k].x = sums[k].y = sums[k].z = 0;
+				sums[k].maxlab = 0;
+				sums[k].count = 0;
+			}
+
+#pragma omp for schedule(guided)
+			for (int r = 0; r < rows; r++)
+			{
+				const int z = r / height;
+				const int y = r % height;
+				const size_t row = (size_t)y * width;
+				const int tile = (z / bandheight) * ybands + y / bandheight;
+				const planar_row planes = {m_lvecvec[z] + row, m_avecvec[z] + row, m_bvecvec[z] + row};
+				int *labels = klabels[z] + row;
+
+				for (int x = 0; x < width; x++)
+					distvec[x] = LAB_MAX;
+
+				for (int s = bandstart[tile]; s < bandstart[tile + 1]; s++)
+				{
+					const int n = bandseeds[s];
+					if (!((int)(kseedsz[n] - offset) <= z && z < (int)(kseedsz[n] + offset)) ||
+						!((int)(kseedsy[n] - offset) <= y && y < (int)(kseedsy[n] + offset)))
+					{
+						continue;
+					}
+
+					const int x1 = max(0, (int)(kseedsx[n] - offset));
+					const int x2 = min(width, (int)(kseedsx[n] + offset));
+					distances += max(0, x2 - x1);
+
+					assign_seed seed;
+					seed.l = kseedsl[n];
+					seed.a = kseedsa[n];
+					seed.b = kseedsb[n];
+					seed.x = kseedsx[n];
+					seed.cons_y = (y - kseedsy[n]) * (y - kseedsy[n]) + (z - kseedsz[n]) * (z - kseedsz[n]);
+					seed.inv_maxlab = 1 / maxlab[n];
+					seed.invxywt = invxywt;
+					seed.n = n;
+
+					AssignRow(planes, distlab, distvec, labels, x1, x2, seed);
+				}
+
+				for (int x = 0; x < width; x++)
+				{
+					cluster_sum &sum = sums[labels[x]];
+					if (sum.maxlab < distlab[x])
+						sum.maxlab = distlab[x];
+					sum.l += planes.l[x];
+					sum.a += planes.a[x];
+					sum.b += planes.b[x];
+					sum.x += x;
+					sum.y += y;
+					sum.z += z;
+					sum.count++;
+				}
+			}
+
+#pragma omp master
+			updateStart = Clock::now();
+
+#pragma omp for reduction(+ \
+						  : residual)
+			for (int k = 0; k < numk; k++)
+			{
+				cluster_sum total = m_clustersums[k];
+				for (int t = 1; t < thread_num; t++)
+				{
+					const cluster_sum &sum = m_clustersums[(size_t)t * numk + k];
+					total.l += sum.l;
+					total.a += sum.a;
+					total.b += sum.b;
+					total.x += sum.x;
+					total.y += sum.y;
+					total.z += sum.z;
+					total.maxlab = max(total.maxlab, sum.maxlab);
+					total.count += sum.count;
+				}
+				maxlab[k] = max(maxlab[k], total.maxlab);
+				if (total.count == 0)
+					continue; // no voxel chose this seed, leave it where it is
+
+				const double inv = 1.0 / double(total.count);
+				const double newx = total.x * inv;
+				const double newy = total.y * inv;
+				const double newz = total.z * inv;
+				residual += sqrt((newx - kseedsx[k]) * (newx - kseedsx[k]) +
+								 (newy - kseedsy[k]) * (newy - kseedsy[k]) +
+								 (newz - kseedsz[k]) * (newz - kseedsz[k]));
+
+				kseedsl[k] = total.l * inv;
+				kseedsa[k] = total.a * inv;
+				kseedsb[k] = total.b * inv;
+				kseedsx[k] = newx;
+				kseedsy[k] = newy;
+				kseedsz[k] = newz;
+			}
+		}
+
+		Clock::time_point updateEnd = Clock::now();
+		m_stats.assign_ms.push_back(ElapsedMs(assignStart, updateStart));
+		m_stats.update_ms.push_back(ElapsedMs(updateStart, updateEnd));
+		m_stats.residual = numk > 0 ? residual / numk / STEP : 0;
+		m_stats.iterations = numitr + 1;
+		if (m_threshold > 0 && m_stats.residual < m_threshold)
+			break;
+	}
+	m_stats.distances = distances;
+}
+
+//===========================================================================
+///	EnforceSupervoxelLabelConnectivity
+///
+///	EnforceLabelConnectivity for volumes, with 6-connected components (the
+/// in-slice and cross-slice entries of dx10/dy10/dz10), indexed with size_t
+/// since a volume can hold more than INT_MAX voxels. Components are
+/// numbered in raster order; one of at most a quarter of the average size of
+/// K supervoxels takes the label of the last already numbered 6-neighbour
+/// of its first voxel. A serial flood fill, with the queue in m_voxelqueue.
+//===========================================================================
+void SLIC::EnforceSupervoxelLabelConnectivity(
+	int **labels,
+	const int &width,
+	const int &height,
+	const int &depth,
+	int &numlabels,
+	const int &K)
+{
+	const int six[6] = {0, 1, 2, 3, 8, 9}; //-x, -y, +x, +y, -z, +z in dx10/dy10/dz10
+
+	const size_t sz = (size_t)width * height;
+	const size_t vol = sz * depth;
+	const size_t SUPSZ = vol / K;
+	int *nlabels = m_nlabels.data();
+	size_t *queue = m_voxelqueue.data();
+	std::fill(nlabels, nlabels + vol, -1);
+
+	int label = 0;
+	int adjlabel = 0; //adjacent label
+	for (int d = 0; d < depth; d++)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const size_t i = (size_t)y * width + x;
+				const size_t v = d * sz + i;
+				if (nlabels[v] >= 0)
+					continue;
+				nlabels[v] = label;
+				const int original = labels[d][i];
+
+				//--------------------
+				// Quickly find an adjacent label for use later if needed
+				//--------------------
+				for (int j = 0; j < 6; j++)
+				{
+					const int n = six[j];
+					const int xx = x + dx10[n], yy = y + dy10[n], dd = d + dz10[n];
+					if (xx >= 0 && xx < width && yy >= 0 && yy < height && dd >= 0 && dd < depth)
+					{
+						const size_t nv = dd * sz + (size_t)yy * width + xx;
+						if (nlabels[nv] >= 0)
+							adjlabel = nlabels[nv];
+					}
+				}
+
+				size_t count = 1;
+				queue[0] = v;
+				for (size_t c = 0; c < count; c++)
+				{
+					const int cd = queue[c] / sz;
+					const size_t ci = queue[c] % sz;
+					const int cy = ci / width;
+					const int cx = ci % width;
+					for (int j = 0; j < 6; j++)
+					{
+						const int n = six[j];
+						const int xx = cx + dx10[n], yy = cy + dy10[n], dd = cd + dz10[n];
+						if (xx >= 0 && xx < width && yy >= 0 && yy < height && dd >= 0 && dd < depth)
+						{
+							const size_t ni = (size_t)yy * width + xx;
+							const size_t nv = dd * sz + ni;
+							if (nlabels[nv] < 0 && labels[dd][ni] == original)
+							{
+								nlabels[nv] = label;
+								queue[count++] = nv;
+							}
+						}
+					}
+				}
+
+				//-------------------------------------------------------
+				// If segment size is less then a limit, assign an
+				// adjacent label found before, and decrement label count.
+				//-------------------------------------------------------
+				if (count <= SUPSZ >> 2)
+				{
+					for (size_t c = 0; c < count; c++)
+						nlabels[queue[c]] = adjlabel;
+					label--;
+				}
+				label++;
+			}
+		}
+	}
+
+#if _OPENMP
+#pragma omp parallel for
+#endif
+	for (int d = 0; d < depth; d++)
+		std::copy(nlabels + d * sz, nlabels + (d + 1) * sz, labels[d]);
+	numlabels = label;
+}
+
+//===========================================================================
+///	PerformSupervoxelSLICO_ForGivenK
+///
+/// Zero parameter SLICO for a volume and a given number K of supervoxels.
+/// There is no seed perturbation, the grid seeds are used as they are.
+//===========================================================================
+void SLIC::PerformSupervoxelSLICO_ForGivenK(
+	const unsigned int **ubuffvec,
+	const int width,
+	const int height,
+	const int depth,
+	int **klabels,
+	int &numlabels,
+	const int &K, //required number of supervoxels
+	const double &m)
+{
+	auto totalStart = Clock::now();
+	m_width = width;
+	m_height = height;
+
+	InitRGBtoLABLUT();
+	ReserveSupervoxelWorkspace(width, height, depth);
+	auto startTime = Clock::now();
+	DoRGBtoLABConversion(ubuffvec, m_lvecvec, m_avecvec, m_bvecvec);
+	m_stats.rgb2lab_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.pixels = (long long)width * height * depth;
+	m_stats.dirty = m_stats.pixels;
+	m_stats.isa = Kernels().isa;
 
-	int *nlabels = new int[sz];
 	startTime = Clock::now();
-	EnforceLabelConnectivity(klabels, m_width, m_height, nlabels, numlabels, K);
+	m_warm_K = 0; //the 2D seeds are overwritten
+	m_stats.warm = false;
+	const double step = GetLABXYZSeeds_ForGivenK(K);
+	m_stats.seeds_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.seeds = m_kseedsl.size();
+
+	int STEP = step + 2.0;
+	startTime = Clock::now();
+	PerformSupervoxelSegmentation_VariableSandM(klabels, STEP, m_maxitr);
+	m_stats.segmentation_ms = ElapsedMs(startTime, Clock::now());
+
+	startTime = Clock::now();
+	EnforceSupervoxelLabelConnectivity(klabels, width, height, depth, numlabels, K);
+	m_stats.connectivity_ms = ElapsedMs(startTime, Clock::now());
+	m_stats.labels = numlabels;
+
+	m_stats.total_ms = ElapsedMs(totalStart, Clock::now());
+	if (m_verbose)
+		PrintStats(std::cout);
+}
+
+//===========================================================================
+///	PrintStats
+///
+///	Human readable dump of GetStats(), one phase per line.
+//===========================================================================
+void SLIC::PrintStats(std::ostream &os) const
+{
+	const Stats &st = m_stats;
+	os << "Kernels: " << st.isa << endl;
+	os << "RGB2LAB Conversion time: " << st.rgb2lab_ms << " ms" << endl;
+	os << "GetLABXYSeeds time: " << st.seeds_ms << " ms" << (st.warm ? " (warm start)" : "") << endl;
+	os << "SuperpixelSegmentation time=" << st.segmentation_ms << " ms"
+	   << " (" << st.iterations << " iterations, E=" << st.residual << ")" << endl;
+	for (int i = 0; i < st.iterations; i++)
 	{
-		// memcpy(klabels, nlabels, sz * sizeof(int));
+		os << "  iteration " << i << ": assign " << st.assign_ms[i] << " ms, update " << st.update_ms[i] << " ms" << endl;
 	}
-	endTime = Clock::now();
-	compTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
-	std::cout << "EnforceLabelConnectivity time=" << compTime.count() / 1000 << " ms" << endl;
-	if (nlabels)
-		delete[] nlabels;
+	os << "EnforceLabelConnectivity time=" << st.connectivity_ms << " ms" << endl;
+	os << "Total: " << st.total_ms << " ms, " << st.pixels << " pixels (" << st.dirty << " reassigned), " << st.seeds << " seeds, "
+	   << st.distances << " distance evaluations, " << st.labels << " labels" << endl;
 }
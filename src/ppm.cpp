@@ -0,0 +1,169 @@
+// ppm.cpp: P6 image helpers shared by main and bench.
+//===========================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ppm.h"
+
+//===========================================================================
+/// Map PPM file
+///
+/// Maps a P6 file read-only and parses its header in place. rgb points at
+/// the first pixel of the payload inside the mapping, rows are 3 * width
+/// bytes apart. Release with UnmapPPM.
+//===========================================================================
+bool MapPPM(char *filename, void **map, size_t *mapsize, const unsigned char **rgb, int *width, int *height)
+{
+	*map = NULL;
+	*mapsize = 0;
+	*width = 0;
+	*height = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+	madvise(addr, size, MADV_SEQUENTIAL);
+
+	const char *p = (const char *)addr;
+	const char *end = p + size;
+	int line = 0;
+	const char *header = p;
+
+	// read the image type, such as: P6
+	// skip the comment lines
+	while (line < 2 && p < end)
+	{
+		header = p;
+		while (p < end && *p != '\n')
+			p++;
+		if (p < end)
+			p++;
+		if (header[0] != '#')
+		{
+			++line;
+		}
+	}
+	// read width and height, from a NUL-terminated copy of the line: the
+	// mapping has no terminator and sscanf would scan on into the payload
+	char dims[64];
+	size_t len = p - header;
+	if (len >= sizeof(dims))
+		len = sizeof(dims) - 1;
+	memcpy(dims, header, len);
+	dims[len] = '\0';
+	if (line < 2 || sscanf(dims, "%d %d", width, height) != 2)
+	{
+		munmap(addr, size);
+		*width = *height = 0;
+		return false;
+	}
+
+	// skip the maximum of pixels
+	while (p < end && *p != '\n')
+		p++;
+	if (p < end)
+		p++;
+
+	if (p + (size_t)(*width) * (*height) * 3 > end)
+	{
+		munmap(addr, size);
+		*width = *height = 0;
+		return false;
+	}
+
+	*map = addr;
+	*mapsize = size;
+	*rgb = (const unsigned char *)p;
+	return true;
+}
+
+void UnmapPPM(void *map, size_t mapsize)
+{
+	if (map)
+		munmap(map, mapsize);
+}
+
+//===========================================================================
+/// Check labels with PPM file
+///
+/// Compares labels against a label image saved as P6, one label per pixel
+/// in the 24 bit colour. Returns the number of differing pixels, or -1.
+//===========================================================================
+int CheckLabelswithPPM(char *filename, int *labels, int width, int height)
+{
+	char header[1024];
+	FILE *fp = NULL;
+	int line = 0, ground = 0;
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return -1;
+
+	// read the image type, such as: P6
+	// skip the comment lines
+	while (line < 2)
+	{
+		fgets(header, 1024, fp);
+		if (header[0] != '#')
+		{
+			++line;
+		}
+	}
+	// read width and height
+	int w(0);
+	int h(0);
+	sscanf(header, "%d %d\n", &w, &h);
+	if (w != width || h != height)
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	// read the maximum of pixels
+	fgets(header, 20, fp);
+
+	// get rgb data
+	unsigned char *rgb = new unsigned char[(w) * (h)*3];
+	fread(rgb, (w) * (h)*3, 1, fp);
+
+	int num = 0, k = 0;
+	for (int i = 0; i < (h); i++)
+	{
+		for (int j = 0; j < (w); j++)
+		{
+			unsigned char *p = rgb + i * (w)*3 + j * 3;
+			// a ( skipped )
+			ground = p[2] << 16; // r
+			ground |= p[1] << 8; // g
+			ground |= p[0];		 // b
+
+			if (ground != labels[k])
+				num++;
+
+			k++;
+		}
+	}
+
+	// ofc, later, you'll have to cleanup
+	delete[] rgb;
+
+	fclose(fp);
+
+	return num;
+}